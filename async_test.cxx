@@ -0,0 +1,168 @@
+#include <coroutine>
+#include <deque>
+#include <stdexcept>
+#include <vector>
+
+#include "lua_async.hxx"
+
+#define ASSERT(condition)                                           \
+do {                                                                \
+    if(!(condition))                                                \
+        throw std::runtime_error(std::string( __FILE__ )            \
+                                + std::string( ":" )                \
+                                + std::to_string( __LINE__ )        \
+        );                                                          \
+} while (0)
+
+using namespace luai;
+
+// coroutines waiting for the next tick of the test loop, like I/O completing later
+std::deque<std::coroutine_handle<>> ready;
+
+struct next_tick {
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) { ready.push_back(h); }
+    void await_resume() const noexcept {}
+};
+
+void run_ticks() {
+    while (!ready.empty()) {
+        auto h = ready.front();
+        ready.pop_front();
+        h.resume();
+    }
+}
+
+// a coroutine owning its frame, destroyed with it
+struct owned_task {
+    struct promise_type {
+        owned_task get_return_object() { return {std::coroutine_handle<promise_type>::from_promise(*this)}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() { throw; }
+    };
+
+    std::coroutine_handle<promise_type> h;
+
+    ~owned_task() { h.destroy(); }
+};
+
+owned_task await_once(coroutine &co) {
+    co_await resume_async(co);
+}
+
+// frames of async functions alive
+int frames = 0;
+
+struct frame_count {
+    frame_count() { ++frames; }
+    ~frame_count() { --frames; }
+};
+
+async<long long> serve(lua_interpreter &state, const char *handler, long long x) {
+    auto co = state.new_coroutine(handler);
+    auto status = co_await resume_async(co, x);
+    if (status != co_status::DONE)
+        throw std::runtime_error{co.error()};
+    co_return co.get<long long>(1);
+}
+
+int main() {
+    auto state = lua_interpreter{};
+    state.openlibs();
+    register_async(state, "double_later", [](long long x) -> async<long long> {
+        co_await next_tick{};
+        co_return x * 2;
+    });
+    register_async(state, "fail_later", [](std::string msg) -> async<> {
+        co_await next_tick{};
+        throw std::runtime_error{msg};
+    });
+    register_async(state, "counted_later", [](long long x) -> async<long long> {
+        frame_count counted;
+        co_await next_tick{};
+        co_return x;
+    });
+    register_async(state, "split_now", [](long long x) -> async<std::tuple<long long, long long>> {
+        co_return std::make_tuple(x / 10, x % 10);
+    });
+    ASSERT(std::get<0>(state.run_chunk(
+        "function handler(x)\n"
+        "    local a = double_later(x)\n"
+        "    local b = double_later(a)\n"
+        "    local tens, ones = split_now(42)\n"
+        "    return a + b + tens + ones\n"
+        "end\n"
+        "function failing(x)\n"
+        "    local ok, err = pcall(fail_later, 'no route')\n"
+        "    assert(not ok and err == 'no route')\n"
+        "    fail_later('gave up')\n"
+        "end\n"
+    )));
+
+    // many scripts in flight on one thread, each parked twice
+    {
+        std::vector<async<long long>> requests;
+        for (auto i = 0; i < 100; ++i)
+            requests.push_back(serve(state, "handler", i));
+        ASSERT(!requests[0].done() && ready.size() == 100);
+        run_ticks();
+        for (auto i = 0; i < 100; ++i)
+            ASSERT(requests[i].done() && requests[i].get() == 6 * i + 6);
+    }
+
+    // errors of async functions are lua errors in the script
+    {
+        auto request = serve(state, "failing", 0);
+        run_ticks();
+        ASSERT(request.done());
+        auto thrown = false;
+        try {
+            request.get();
+        } catch (const std::runtime_error &e) {
+            thrown = std::string{e.what()}.find("gave up") != std::string::npos;
+        }
+        ASSERT(thrown);
+    }
+
+    // async functions need a coroutine to park
+    auto ret = state.run_chunk("double_later(1)");
+    ASSERT(!std::get<0>(ret) && std::get<1>(ret).find("outside a coroutine") != std::string::npos);
+
+    // resuming by hand works once the function completed
+    {
+        auto co = state.new_coroutine("handler");
+        ASSERT(co.resume(1) == co_status::SUSPENDED && co.size() == 2);
+        run_ticks();
+        ASSERT(co.resume() == co_status::SUSPENDED);
+        run_ticks();
+        ASSERT(co.resume() == co_status::DONE && co.get<long long>(1) == 12);
+    }
+
+    // a thread collected while parked leaves the frame queued, it finishes once resumed
+    {
+        state.run_chunk("function counting() counted_later(1) end");
+        {
+            auto co = state.new_coroutine("counting");
+            ASSERT(co.resume() == co_status::SUSPENDED);
+        }
+        state.run_chunk("collectgarbage()");
+        ASSERT(frames == 1 && ready.size() == 1);
+        run_ticks();
+        ASSERT(frames == 0);
+    }
+
+    // destroying the awaiting coroutine while parked leaves the lua thread suspended
+    {
+        auto co = state.new_coroutine("counting");
+        {
+            auto host = await_once(co);
+            ASSERT(co.status() == co_status::SUSPENDED && ready.size() == 1);
+        }
+        run_ticks();
+        ASSERT(frames == 0 && co.status() == co_status::SUSPENDED);
+        ASSERT(co.resume() == co_status::DONE);
+    }
+    ASSERT(ready.empty());
+}
@@ -0,0 +1,59 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "lua.hpp"
+#include "lua_interpreter.hxx"
+
+using namespace luai;
+
+struct counter {
+    long long value = 0;
+
+    long long add(long long n) { return value += n; }
+};
+
+// what one would write by hand for counter:add()
+int hand_add(lua_State *L) {
+    auto self = static_cast<counter *>(lua_touserdata(L, 1));
+    if (self == NULL)
+        return luaL_argerror(L, 1, "counter expected");
+    lua_pushinteger(L, self->add(luaL_checkinteger(L, 2)));
+    return 1;
+}
+
+// runs the loop body n times in a script, returns nanoseconds per iteration
+double time_loop(lua_interpreter &state, const std::string &body, long long n) {
+    auto code = "local c, add, hand_add = c, c.add, hand_add\n"
+                "for i = 1, " + std::to_string(n) + " do " + body + " end";
+    auto start = std::chrono::steady_clock::now();
+    auto result = state.run_chunk(code.c_str());
+    auto stop = std::chrono::steady_clock::now();
+    if (!std::get<0>(result)) {
+        std::cerr << "error: " << std::get<1>(result) << std::endl;
+        std::exit(1);
+    }
+    return std::chrono::duration<double, std::nano>(stop - start).count() / static_cast<double>(n);
+}
+
+int main(int argc, char **argv) {
+    auto n = argc > 1 ? std::atoll(argv[1]) : 10000000LL;
+
+    auto state = lua_interpreter{};
+    state.openlibs();
+    state.register_class<counter>("counter")
+        .constructor<>()
+        .method("add", &counter::add)
+        .property("value", &counter::value);
+    state.register_function("hand_add", hand_add);
+    state.run_chunk("c = counter.new()");
+
+    auto empty = time_loop(state, "", n);
+    std::cout << "iterations:                " << n << "\n"
+              << "empty loop:                " << empty << " ns\n"
+              << "hand-written add(c, 1):    " << time_loop(state, "hand_add(c, 1)", n) - empty << " ns\n"
+              << "bound add(c, 1):           " << time_loop(state, "add(c, 1)", n) - empty << " ns\n"
+              << "bound c:add(1):            " << time_loop(state, "c:add(1)", n) - empty << " ns\n"
+              << "bound c.value:             " << time_loop(state, "local v = c.value", n) - empty << " ns\n";
+}
@@ -1,4 +1,9 @@
+#include <algorithm>
+#include <climits>
+#include <map>
 #include <stdexcept>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "lua_interpreter.hxx"
@@ -25,6 +30,47 @@ do {                                                                \
 
 using namespace luai;
 
+struct point {
+    double x, y;
+};
+
+struct shape {
+    std::string name;
+    int id;
+    point origin;
+    std::vector<point> vertices;
+    std::vector<std::string> tags;
+};
+
+namespace luai {
+template<> struct struct_schema<point> {
+    static auto fields() {
+        return std::make_tuple(field("x", &point::x), field("y", &point::y));
+    }
+};
+template<> struct struct_schema<shape> {
+    static auto fields() {
+        return std::make_tuple(field("name", &shape::name), field("id", &shape::id),
+            field("origin", &shape::origin), field("vertices", &shape::vertices), field("tags", &shape::tags));
+    }
+};
+template<> struct ptr_tag<point> { static constexpr std::uint16_t value = 1; };
+template<> struct ptr_tag<shape> { static constexpr std::uint16_t value = 2; };
+} // namespace luai
+
+// vectors nested N times, about as deep as the stack lua guarantees to C code
+template<int N>
+struct nested {
+    using type = std::vector<typename nested<N - 1>::type>;
+    static type make() { return {nested<N - 1>::make()}; }
+};
+
+template<>
+struct nested<0> {
+    using type = long long;
+    static type make() { return 42; }
+};
+
 // my helper function to get field recursively
 // len of names must >= 1
 template<types Type>
@@ -39,6 +85,29 @@ auto get_field_recur(lua_interpreter &state, const std::vector<std::string> &nam
     // table handles destructed
 }
 
+struct account {
+    static int alive;
+    std::string owner;
+    double balance;
+    long long id;
+
+    account(std::string name, double initial) : owner{std::move(name)}, balance{initial}, id{42} { ++alive; }
+    ~account() { --alive; }
+
+    double deposit(double amount) {
+        if (amount <= 0)
+            throw std::invalid_argument{"deposit must be positive"};
+        return balance += amount;
+    }
+    std::string describe() const { return owner + ": " + std::to_string(static_cast<long long>(balance)); }
+};
+
+int account::alive = 0;
+
+long long hypot2(long long a, long long b) {
+    return a * a + b * b;
+}
+
 int main() {
     auto state = lua_interpreter{};
     state.openlibs();
@@ -145,6 +214,688 @@ int main() {
             .get_field<types::TABLE>("kk")
             .get_index<types::BOOL>(16) == true);
 
+    // string views keep the string on the stack, so they follow table handle scoping rules
+    state.run_chunk(
+        "bin = 'ab\\0cd'\n"
+        "sv = { name = 'lua', 42 }\n"
+    );
+    ASSERT(state.get_global<types::STR>("bin") == std::string("ab\0cd", 5));
+    {
+        auto bin = state.get_global<types::STRVIEW>("bin");
+        ASSERT(bin.size() == 5);
+        ASSERT(bin.str() == std::string("ab\0cd", 5));
+        auto sv = state.get_global<types::TABLE>("sv");
+        auto name = sv.get_field<types::STRVIEW>("name");
+        ASSERT(name.str() == "lua");
+        // numbers are converted
+        ASSERT(sv.get_index<types::STRVIEW>(1).str() == "42");
+        ASSERT(sv.get_field<types::STR>("name") == "lua");
+        SHOULD_THROW(sv.get_field<types::STRVIEW>("nothing"));
+    }
+    ASSERT(state.get_global<types::INT>("x") == 15);
+
+    // read many fields at once
+    state.run_chunk(
+        "rec = { id = 3, score = 9.5, name = 'bob', ok = true }\n"
+    );
+    {
+        auto rec = state.get_global<types::TABLE>("rec");
+        auto fields = rec.get_fields<types::INT, types::NUM, types::STR, types::BOOL, types::LTYPE>(
+            "id", "score", "name", "ok", "missing");
+        ASSERT(std::get<0>(fields) == 3);
+        ASSERT(std::get<1>(fields) == 9.5);
+        ASSERT(std::get<2>(fields) == "bob");
+        ASSERT(std::get<3>(fields) == true);
+        ASSERT(std::get<4>(fields) == types::NIL);
+        SHOULD_THROW((rec.get_fields<types::INT, types::INT>("id", "name")));
+        // the stack is left as it was
+        ASSERT(rec.get_field<types::INT>("id") == 3);
+        ASSERT(state.get_global<types::INT>("x") == 15);
+    }
+
+    // structs with a schema
+    state.run_chunk(
+        "tri = { name = 'tri', id = 7, origin = { x = 1, y = 2.5 },\n"
+        "        vertices = { { x = 0, y = 0 }, { x = 1, y = 0 }, { x = 0, y = 1 } }, tags = { 'a', 'b' } }\n"
+        "bad = { name = 'bad', id = 'no' }\n"
+    );
+    {
+        auto tri = state.get_global<shape>("tri");
+        ASSERT(tri.name == "tri" && tri.id == 7);
+        ASSERT(tri.origin.x == 1 && tri.origin.y == 2.5);
+        ASSERT(tri.vertices.size() == 3 && tri.vertices[2].y == 1);
+        ASSERT(tri.tags.size() == 2 && tri.tags[1] == "b");
+        SHOULD_THROW(state.get_global<shape>("bad"));
+        SHOULD_THROW(state.get_global<shape>("x"));
+
+        tri.name = "tri2";
+        tri.vertices.push_back({5, 6});
+        state.set_global("tri2", tri);
+        ASSERT(std::get<0>(state.run_chunk("assert(tri2.name == 'tri2' and #tri2.vertices == 4 and tri2.vertices[4].y == 6)")));
+        auto t = state.get_global<types::TABLE>("tri2");
+        ASSERT(t.get_field<point>("origin").y == 2.5);
+        ASSERT(t.get_field<types::TABLE>("vertices").get_index<point>(4).x == 5);
+        ASSERT(t.decode<shape>().vertices.size() == 4);
+        t.set_field("origin", point{3, 4});
+        ASSERT(t.get_field<types::TABLE>("origin").get_field<types::NUM>("x") == 3);
+        ASSERT(t.get_field<std::vector<std::string>>("tags")[0] == "a");
+    }
+    ASSERT(state.get_global<types::INT>("x") == 15);
+
+    // errors as values
+    {
+        auto xr = state.try_get_global<types::INT>("x");
+        ASSERT(xr && *xr == 15);
+        ASSERT(state.try_get_global<types::INT>("xx").error() == get_error::NIL);
+        ASSERT(state.try_get_global<types::INT>("y").error() == get_error::WRONG_TYPE);
+        ASSERT(state.try_get_global<types::STR>("nope").value_or("default") == "default");
+        ASSERT(!state.try_get_global<types::TABLE>("x"));
+        auto k = state.try_get_global<types::TABLE>("k");
+        ASSERT(k.has_value());
+        ASSERT(k->try_get_field<types::NUM>("spam").value_or(0) == 8.8);
+        ASSERT(k->try_get_field<types::BOOL>("spam").error() == get_error::WRONG_TYPE);
+        auto hehe = k->try_get_field<types::TABLE>("hehe");
+        ASSERT(hehe && hehe->try_get_field<types::INT>("wow").value_or(0) == 9);
+        ASSERT(k->try_get_field<types::TABLE>("none").error() == get_error::NIL);
+        ASSERT(k->try_get_field<types::STRVIEW>("haha")->str() == "8");
+        auto a = state.get_global<types::TABLE>("a");
+        ASSERT(a.try_get_index<types::STR>(3).value_or("") == "haha");
+        ASSERT(a.try_get_index<types::INT>(9).error() == get_error::NIL);
+    }
+    ASSERT(state.get_global<types::INT>("x") == 15);
+
+    // registered keys
+    {
+        auto spam = state.make_key("spam");
+        auto hehe = state.make_key("hehe");
+        auto nope = state.make_key("nope");
+        auto k = state.get_global<types::TABLE>("k");
+        ASSERT(spam.name() == "spam");
+        ASSERT(k.get_field<types::NUM>(spam) == 8.8);
+        ASSERT(k.get_field<types::LTYPE>(nope) == types::NIL);
+        ASSERT(k.get_field<types::TABLE>(hehe).get_field<types::INT>("wow") == 9);
+        SHOULD_THROW(k.get_field<types::INT>(spam));
+        ASSERT(k.try_get_field<types::INT>(nope).error() == get_error::NIL);
+        ASSERT(k.try_get_field<types::TABLE>(hehe).has_value());
+        auto other = lua_interpreter{};
+        auto other_spam = other.make_key("spam");
+        SHOULD_THROW(k.get_field<types::NUM>(other_spam));
+        ASSERT(k.try_get_field<types::NUM>(other_spam).error() == get_error::BAD_KEY);
+        ASSERT(k.try_get_field<types::TABLE>(other_spam).error() == get_error::BAD_KEY);
+        // moving a token gives its registry slot to the new owner, destroying it frees the slot
+        auto moved = std::move(spam);
+        ASSERT(k.get_field<types::NUM>(moved) == 8.8);
+        spam = state.make_key("spam");
+        moved = std::move(spam);
+        ASSERT(k.get_field<types::NUM>(moved) == 8.8);
+    }
+    ASSERT(state.get_global<types::INT>("x") == 15);
+
+    // setters
+    state.set_global<types::INT>("si", 42);
+    state.set_global<types::NUM>("sn", 4.5);
+    state.set_global<types::STR>("ss", std::string("a\0b", 3));
+    state.set_global<types::BOOL>("sb", true);
+    ASSERT(std::get<0>(state.run_chunk("assert(si == 42 and math.type(si) == 'integer' and sn == 4.5 and ss == 'a\\0b' and sb)")));
+    state.set_global<types::NIL>("sb", nullptr);
+    ASSERT(state.get_global<types::LTYPE>("sb") == types::NIL);
+    {
+        auto k = state.get_global<types::TABLE>("k");
+        auto a = state.get_global<types::TABLE>("a");
+        k.set_field<types::INT>("haha", 80);
+        k.set_field<types::TABLE>("arr", a);
+        k.set_field<types::STR>(state.make_key("tok"), "token");
+        a.set_index<types::NUM>(6, 0.5);
+        a.set_index(7, std::string{"seven"});
+        state.set_global<types::TABLE>("kcopy", k);
+        ASSERT(k.get_field<types::INT>("haha") == 80);
+        ASSERT(a.len() == 7);
+        auto other = lua_interpreter{};
+        SHOULD_THROW(k.set_field<types::TABLE>("bad", other.get_global<types::TABLE>("_G")));
+    }
+    ASSERT(std::get<0>(state.run_chunk("assert(kcopy == k and k.arr == a and a[6] == 0.5 and a[7] == 'seven' and k.tok == 'token')")));
+    state.run_chunk("k.haha = 8 a[6] = nil a[7] = nil k.arr = nil");
+
+    // containers
+    {
+        auto matrix = std::vector<std::vector<double>>{{1, 2}, {3, 4, 5}};
+        auto dict = std::unordered_map<std::string, std::vector<std::string>>{
+            {"fruits", {"apple", "pear"}}, {"empty", {}}};
+        auto sparse = std::map<long long, std::string>{{1, "one"}, {10, "ten"}};
+        state.set_global("matrix", matrix);
+        state.set_global("dict", dict);
+        state.set_global("sparse", sparse);
+        state.set_global("lit", "literal");
+        ASSERT(std::get<0>(state.run_chunk(
+            "assert(#matrix == 2 and matrix[2][3] == 5 and dict.fruits[2] == 'pear' and #dict.empty == 0)\n"
+            "assert(sparse[10] == 'ten' and sparse[2] == nil and lit == 'literal')\n"
+        )));
+        ASSERT(state.get_global<std::vector<std::vector<double>>>("matrix") == matrix);
+        ASSERT((state.get_global<std::unordered_map<std::string, std::vector<std::string>>>("dict") == dict));
+        ASSERT((state.get_global<std::map<long long, std::string>>("sparse") == sparse));
+        SHOULD_THROW((state.get_global<std::map<std::string, long long>>("sparse")));
+        state.set_global("deep", nested<18>::make());
+        ASSERT(state.get_global<nested<18>::type>("deep") == nested<18>::make());
+        state.run_chunk("matrix, dict, sparse, lit, deep = nil");
+    }
+
+    // integers out of the range of the C++ type
+    {
+        state.run_chunk("big, negative = 1 << 40, -1");
+        ASSERT(state.get_global<long long>("big") == 1LL << 40);
+        SHOULD_THROW(state.get_global<int>("big"));
+        SHOULD_THROW(state.get_global<unsigned>("negative"));
+        SHOULD_THROW(state.get_global<std::uint64_t>("negative"));
+        ASSERT(state.get_global<std::int16_t>("negative") == -1);
+        SHOULD_THROW(state.set_global("huge", std::uint64_t{1} << 63));
+        state.set_global("huge", (std::uint64_t{1} << 63) - 1);
+        ASSERT(state.get_global<std::uint64_t>("huge") == (std::uint64_t{1} << 63) - 1);
+        state.run_chunk("big, negative, huge = nil");
+    }
+    ASSERT(state.get_global<types::INT>("x") == 15);
+
+    // host buffers as userdata
+    {
+        double frame[] = {1.5, 2.5, 3.5};
+        state.set_global("frame", array_view<double>::borrowed(frame, 3));
+        auto ids = std::unique_ptr<std::int64_t[]>{new std::int64_t[4]{10, 20, 30, 40}};
+        state.set_global("ids", array_view<std::int64_t>::owned(std::move(ids), 4));
+        auto ret = state.run_chunk(
+            "assert(#frame == 3 and frame[1] == 1.5 and frame[4] == nil)\n"
+            "frame[2] = 9\n"
+            "local sum = 0\n"
+            "for i, v in ipairs(frame) do sum = sum + v end\n"
+            "assert(sum == 14)\n"
+            "local n = 0\n"
+            "for i, v in pairs(ids) do n = n + 1 assert(v == i * 10 and math.type(v) == 'integer') end\n"
+            "assert(n == 4)\n"
+            "assert(not pcall(function() frame[4] = 1 end))\n"
+            "assert(not pcall(function() ids[1] = 1.5 end))\n"
+        );
+        ASSERT(std::get<0>(ret));
+        ASSERT(frame[1] == 9);
+        auto idview = state.get_global<array_view<std::int64_t>>("ids");
+        ASSERT(idview.size() == 4 && idview[3] == 40);
+        SHOULD_THROW(state.get_global<array_view<double>>("ids"));
+        state.run_chunk("frame, ids = nil collectgarbage()");
+        // still owned by idview
+        ASSERT(idview[0] == 10);
+    }
+
+    // data shared by many interpreters
+    {
+        auto loader = lua_interpreter{};
+        loader.run_chunk(
+            "dataset = { version = 3, name = 'ref', tags = { 'a', 'b' },\n"
+            "            rows = { { id = 1, v = 0.5 }, { id = 2, v = 1.5 } } }\n"
+            "cyc = {} cyc.self = cyc\n"
+        );
+        auto dataset = loader.get_global<shared_value>("dataset");
+        ASSERT(dataset.get("rows").size() == 2 && dataset.get("name").as_str() == "ref");
+        ASSERT(dataset.get("rows").at(1).get("v").as_num() == 1.5);
+        SHOULD_THROW(loader.get_global<shared_value>("cyc"));
+
+        auto ok = std::vector<int>(4, 0);
+        auto workers = std::vector<std::thread>{};
+        for (size_t i = 0; i < ok.size(); ++i)
+            workers.emplace_back([&dataset, &ok, i] {
+                auto worker = lua_interpreter{};
+                worker.openlibs();
+                worker.set_global("data", dataset);
+                auto r = worker.run_chunk(
+                    "assert(data.version == 3 and data.name == 'ref' and #data.rows == 2)\n"
+                    "assert(data.rows[2].v == 1.5 and data.rows == data.rows and data.missing == nil)\n"
+                    "local n = 0 for k, v in pairs(data) do n = n + 1 end assert(n == 4)\n"
+                    "local s = 0 for i, row in ipairs(data.rows) do s = s + row.id end assert(s == 3)\n"
+                    "assert(not pcall(function() data.version = 4 end))\n"
+                );
+                ok[i] = std::get<0>(r);
+            });
+        for (auto &w : workers)
+            w.join();
+        for (auto r : ok)
+            ASSERT(r);
+        // proxies convert back to the same data
+        state.set_global("data", dataset);
+        ASSERT(state.get_global<shared_value>("data").identity() == dataset.identity());
+        state.run_chunk("data = nil");
+    }
+
+    // building tables
+    {
+        auto rows = state.build_table(3);
+        for (auto i = 1; i <= 3; ++i)
+            rows.append(point{static_cast<double>(i), i * 0.5});
+        ASSERT(rows.size() == 3);
+        rows.build_global("rows");
+
+        auto result = state.build_table(2, 2);
+        result.append(10).append(std::string{"twenty"}).set("ok", true).set("count", 2);
+        auto handle = result.build();
+        ASSERT(handle.len() == 2 && handle.get_index<types::STR>(2) == "twenty");
+        auto sub = state.build_table(0, 1);
+        sub.set("inner", 1.5);
+        sub.build_field(handle, "sub");
+        state.set_global<types::TABLE>("result", handle);
+        auto empty = state.new_table();
+        ASSERT(empty.len() == 0);
+    }
+    ASSERT(std::get<0>(state.run_chunk(
+        "assert(#rows == 3 and rows[3].x == 3 and rows[2].y == 1)\n"
+        "assert(result[1] == 10 and result.ok and result.count == 2 and result.sub.inner == 1.5)\n"
+        "rows, result = nil\n"
+    )));
+    ASSERT(state.get_global<types::INT>("x") == 15);
+
+    // columns of record arrays
+    state.run_chunk(
+        "records = {}\n"
+        "for i = 1, 100 do records[i] = { id = i, score = i / 4, name = 'r' .. i } end\n"
+        "broken = { { id = 1, score = 1 }, { id = 2 } }\n"
+    );
+    {
+        auto ids = std::vector<long long>{};
+        auto scores = std::vector<float>{};
+        auto names = std::vector<std::string>{};
+        auto records = state.get_global<types::TABLE>("records");
+        ASSERT(records.get_columns(column("id", ids), column("score", scores), column("name", names)) == 100);
+        ASSERT(ids.size() == 100 && scores.size() == 100 && names.size() == 100);
+        ASSERT(ids[41] == 42 && scores[41] == 10.5f && names[99] == "r100");
+        auto broken = state.get_global<types::TABLE>("broken");
+        SHOULD_THROW(broken.get_columns(column("id", ids), column("score", scores)));
+        ASSERT(broken.len() == 2 && records.len() == 100);
+    }
+    state.run_chunk("records, broken = nil");
+
+    // MessagePack
+    state.run_chunk(
+        "packed = { 1, -1, 200, -200, 70000, -70000, 1 << 40, 0.5, 0.1, true, false, 'str', string.rep('x', 300),\n"
+        "    { a = 1, b = { 'nested' } }, {} }\n"
+        "cyclic = {} cyclic.self = cyclic\n"
+    );
+    {
+        auto buf = std::string{"prefix"};
+        state.pack_global("packed", buf);
+        ASSERT(buf.compare(0, 6, "prefix") == 0 && static_cast<unsigned char>(buf[6]) == 0x9f);
+        auto size = buf.size();
+        SHOULD_THROW(state.pack_global("cyclic", buf));
+        ASSERT(buf.size() == size);
+        state.unpack_global("unpacked", buf.data() + 6, buf.size() - 6);
+        SHOULD_THROW(state.unpack_global("bad", buf.data() + 6, buf.size() - 7));
+        SHOULD_THROW(state.unpack_global("bad", buf.data(), buf.size()));
+        auto small = std::string{};
+        state.get_global<types::TABLE>("unpacked").get_index<types::TABLE>(14).pack(small);
+        ASSERT(small.size() == 14);
+    }
+    state.open_msgpack();
+    ASSERT(std::get<0>(state.run_chunk(
+        "local function same(a, b)\n"
+        "    if type(a) ~= 'table' then return a == b and math.type(a) == math.type(b) end\n"
+        "    for k, v in pairs(a) do if not same(v, b[k]) then return false end end\n"
+        "    for k in pairs(b) do if a[k] == nil then return false end end\n"
+        "    return true\n"
+        "end\n"
+        "assert(same(packed, unpacked))\n"
+        "assert(same(packed, msgpack.unpack(msgpack.pack(packed))))\n"
+        "assert(msgpack.unpack(msgpack.pack(-9007199254740993)) == -9007199254740993)\n"
+        "assert(not pcall(msgpack.pack, cyclic))\n"
+        "assert(not pcall(msgpack.pack, print))\n"
+        "assert(not pcall(msgpack.unpack, '\\xc1'))\n"
+        "assert(require('msgpack') == msgpack)\n"
+    )));
+    state.run_chunk("packed, unpacked, cyclic, msgpack = nil");
+
+    // JSON
+    {
+        const auto text = std::string{
+            "{\"id\": 7, \"ratio\": 2.5, \"ok\": true, \"none\": null, \"tags\": [\"a\", \"b\\n\\u00e9\\ud83d\\ude00\"],"
+            " \"nested\": {\"list\": [], \"big\": 12345678901234567890, \"neg\": -9223372036854775808}}"};
+        auto doc = state.from_json(text.data(), text.size());
+        ASSERT(doc.get_field<types::INT>("id") == 7 && doc.get_field<types::NUM>("ratio") == 2.5);
+        ASSERT(doc.get_field<types::LTYPE>("none") == types::OTHER);
+        {
+            auto tags = doc.get_field<types::TABLE>("tags");
+            ASSERT(tags.len() == 2 && tags.get_index<types::STR>(2) == "b\n\xc3\xa9\xf0\x9f\x98\x80");
+        }
+        {
+            auto nested = doc.get_field<types::TABLE>("nested");
+            ASSERT(nested.get_field<types::NUM>("big") == 12345678901234567890.0);
+            ASSERT(nested.get_field<types::INT>("neg") == LLONG_MIN);
+        }
+        auto buf = std::string{};
+        doc.to_json(buf);
+        doc.set_field<types::TABLE>("self", doc);
+        auto size = buf.size();
+        SHOULD_THROW(doc.to_json(buf));
+        ASSERT(buf.size() == size);
+        auto again = state.from_json(buf.data(), buf.size());
+        ASSERT(again.get_field<types::NUM>("ratio") == 2.5 && again.get_field<types::LTYPE>("none") == types::OTHER);
+    }
+    SHOULD_THROW(state.from_json("42", 2));
+    SHOULD_THROW(state.from_json("[1, 2", 5));
+    SHOULD_THROW(state.from_json("[1] x", 5));
+    SHOULD_THROW(state.from_json("{\"a\": tru}", 10));
+    state.open_json();
+    ASSERT(std::get<0>(state.run_chunk(
+        "local t = {}\n"
+        "for i = 1, 100 do t[i] = { n = i, half = i / 2, name = 'item ' .. i } end\n"
+        "local wide = {}\n"
+        "for i = 1, 100 do wide['k' .. i] = i end\n"
+        "local back = json.decode(json.encode(t))\n"
+        "assert(#back == 100 and back[100].n == 100 and back[3].half == 1.5 and back[7].name == 'item 7')\n"
+        "assert(math.type(back[4].half) == 'float')\n"
+        "back = json.decode(json.encode(wide))\n"
+        "for i = 1, 100 do assert(back['k' .. i] == i) end\n"
+        "assert(json.encode({ 1, 2, json.null }) == '[1,2,null]')\n"
+        "assert(json.encode('q\"\\\\\\1') == '\"q\\\\\"\\\\\\\\\\\\u0001\"')\n"
+        "assert(json.encode({ [1.5] = true }) == '{\"1.5\":true}')\n"
+        "assert(json.decode(' [ ] ')[1] == nil)\n"
+        "assert(not pcall(json.encode, 0/0))\n"
+        "assert(not pcall(json.encode, { [true] = 1 }))\n"
+        "assert(not pcall(json.decode, '{1: 2}'))\n"
+        "for _, s in ipairs{ '01', '-', '1.', '1e', '1e+', '.5' } do assert(not pcall(json.decode, '[' .. s .. ']'), s) end\n"
+        "for _, x in ipairs{ 0.1, 1 / 3, 5e-324, 1.7976931348623157e308, 2 ^ 60, -0.0 } do\n"
+        "    assert(string.pack('d', json.decode(json.encode({ x }))[1]) == string.pack('d', x))\n"
+        "end\n"
+        "assert(json.encode({ 0.1, 1e21, 1.5e-7, 100.0 }) == '[0.1,1e+21,1.5e-07,100.0]')\n"
+        "assert(require('json') == json)\n"
+    )));
+    state.run_chunk("json = nil");
+
+    // copying between interpreters
+    state.run_chunk(
+        "config = { db = { host = 'localhost', port = 5432, ratio = 0.5, flags = { true, false } } }\n"
+        "config.db.self = config.db\n"
+        "config.db.alias = config.db.flags\n"
+    );
+    {
+        auto worker = lua_interpreter{};
+        worker.openlibs();
+        copy_value(state, "config.db", worker, "db");
+        copy_value(state, "config.db.port", worker, "port");
+        ASSERT(worker.get_global<types::INT>("port") == 5432);
+        auto db = worker.get_global<types::TABLE>("db");
+        ASSERT(db.get_field<types::STR>("host") == "localhost" && db.get_field<types::NUM>("ratio") == 0.5);
+        ASSERT(std::get<0>(worker.run_chunk(
+            "assert(db.self == db and db.alias == db.flags and #db.flags == 2 and db.flags[2] == false)\n"
+            "assert(math.type(db.port) == 'integer')\n"
+        )));
+        SHOULD_THROW(copy_value(state, "config.db.host.x", worker, "x"));
+        SHOULD_THROW(copy_value(state, "print", worker, "x"));
+        SHOULD_THROW(copy_value(state, "config", state, "x"));
+        ASSERT(db.len() == 0);
+    }
+    state.run_chunk("config = nil");
+
+    // tagged pointers
+    {
+        auto origin = point{1, 2};
+        auto box = shape{};
+        state.set_global("origin", ptr<point>{&origin});
+        state.set_global("box", ptr<shape>{&box});
+        state.run_chunk("refs = { origin, box }");
+        ASSERT(state.get_global<ptr<point>>("origin").get() == &origin);
+        ASSERT(state.get_global<ptr<point>>("origin")->y == 2);
+        auto refs = state.get_global<types::TABLE>("refs");
+        ASSERT(refs.get_index<ptr<shape>>(2).get() == &box);
+        SHOULD_THROW(refs.get_index<ptr<point>>(2));
+        SHOULD_THROW(state.get_global<ptr<point>>("box"));
+        SHOULD_THROW(state.get_global<ptr<point>>("x"));
+        state.set_global("none", ptr<const point>{});
+        ASSERT(!state.get_global<ptr<const point>>("none"));
+        SHOULD_THROW(state.get_global<ptr<point>>("none"));
+        state.set_global("fixed", ptr<const point>{&origin});
+        ASSERT(state.get_global<ptr<const point>>("fixed").get() == &origin);
+        ASSERT(state.get_global<ptr<const point>>("origin").get() == &origin);
+        SHOULD_THROW(state.get_global<ptr<point>>("fixed"));
+        // pointers using the top bits, like tagged heap pointers, are boxed
+        auto high = reinterpret_cast<point *>(std::uintptr_t{0xb400000000001000});
+        state.set_global("high", ptr<point>{high});
+        ASSERT(state.get_global<ptr<point>>("high").get() == high);
+        SHOULD_THROW(state.get_global<ptr<shape>>("high"));
+        ASSERT(std::get<0>(state.run_chunk("assert(type(high) == 'userdata')")));
+        state.set_global("high", ptr<shape>{reinterpret_cast<shape *>(high)});
+        SHOULD_THROW(state.get_global<ptr<point>>("high"));
+        state.set_global("high", ptr<const point>{high});
+        ASSERT(state.get_global<ptr<const point>>("high").get() == high);
+        SHOULD_THROW(state.get_global<ptr<point>>("high"));
+    }
+    state.run_chunk("origin, box, refs, none, fixed, high = nil");
+
+    // calling lua functions
+    state.run_chunk(
+        "function divmod(a, b) return a // b, a % b end\n"
+        "function describe(p, label, scale) return label .. ':' .. (p.x * scale), p.y > 0 end\n"
+        "function fails() error('boom') end\n"
+        "function count(t) return #t end\n"
+    );
+    {
+        long long q, r;
+        std::tie(q, r) = state.call<types::INT, types::INT>("divmod", 17, 5);
+        ASSERT(q == 3 && r == 2);
+        auto described = state.call<types::STR, types::BOOL>("describe", point{1.5, 2}, "p", 2);
+        ASSERT(std::get<0>(described) == "p:3.0" && std::get<1>(described));
+        auto list = state.build_table(3).append(1).append(2).append(3).build();
+        ASSERT(std::get<0>(state.call<types::INT>("count", list)) == 3);
+        state.call<>("count", list);
+        SHOULD_THROW(state.call<>("fails"));
+        SHOULD_THROW(state.call<types::INT>("describe", point{1, 2}, "p", 1));
+        SHOULD_THROW(state.call<>("missing"));
+        ASSERT(list.len() == 3);
+    }
+    {
+        auto divmod = state.get_function("divmod");
+        auto sum = 0LL;
+        for (auto i = 0; i < 1000; ++i)
+            sum += std::get<1>(divmod.call<types::INT, types::INT>(i, 7));
+        ASSERT(sum == 2997);
+        state.run_chunk("handlers = { on_event = function(name, n) return name .. n end }");
+        auto handlers = state.get_global<types::TABLE>("handlers");
+        auto on_event = handlers.get_function("on_event");
+        ASSERT(std::get<0>(on_event.call<types::STR>("tick", 3)) == "tick3");
+        SHOULD_THROW(handlers.get_function("missing"));
+        SHOULD_THROW(state.get_function("x"));
+        SHOULD_THROW(state.get_function("fails").call<>());
+        auto moved = std::move(on_event);
+        ASSERT(moved && !on_event);
+        SHOULD_THROW(on_event.call<>());
+        ASSERT(handlers.len() == 0);
+    }
+    {
+        auto outlives = [] {
+            auto temp = lua_interpreter{};
+            temp.run_chunk("function twice(x) return x * 2 end");
+            return temp.get_function("twice");
+        }();
+        ASSERT(std::get<0>(outlives.call<types::NUM>(1.25)) == 2.5);
+    }
+    state.run_chunk("divmod, describe, fails, count, handlers = nil");
+
+    // batch calls
+    state.run_chunk(
+        "function score(id, weight, name)\n"
+        "    if name == 'bad' then error('bad row ' .. id) end\n"
+        "    if name == 'odd' then return 'not a number' end\n"
+        "    return id * weight\n"
+        "end\n"
+    );
+    {
+        auto score = state.get_function("score");
+        auto ids = std::vector<long long>{};
+        auto names = std::vector<std::string>{};
+        for (auto i = 0; i < 100; ++i) {
+            ids.push_back(i);
+            names.push_back(i == 10 || i == 60 ? "bad" : i == 42 ? "odd" : "ok");
+        }
+        double weights[100];
+        for (auto &w : weights)
+            w = 0.5;
+        auto results = std::vector<double>{};
+        auto errors = std::vector<batch_error>{};
+        ASSERT(score.call_batch(results, errors, ids, array_view<double>::borrowed(weights, 100), names) == 3);
+        ASSERT(results.size() == 100 && results[99] == 49.5 && results[10] == 0 && results[42] == 0);
+        ASSERT(errors.size() == 3 && errors[0].row == 10 && errors[1].row == 42 && errors[2].row == 60);
+        ASSERT(errors[2].message.find("bad row 60") != std::string::npos);
+        names.pop_back();
+        SHOULD_THROW(score.call_batch(results, errors, ids, names));
+        ASSERT(errors.size() == 3);
+    }
+    state.run_chunk("score = nil");
+
+    // binding classes
+    ASSERT(!state.has_class<account>());
+    state.register_class<account>("account")
+        .constructor<std::string, double>()
+        .method("deposit", &account::deposit)
+        .method("describe", &account::describe)
+        .property("balance", &account::balance)
+        .property("owner", &account::owner)
+        .readonly("id", &account::id)
+        .readonly("the_identifier_of_this_account_which_is_not_interned", &account::id);
+    ASSERT(state.has_class<account>());
+    {
+        auto &acc = state.new_object<account>("acc", "ann", 10.0);
+        ASSERT(account::alive == 1 && &state.get_object<account>("acc") == &acc);
+        ASSERT(std::get<0>(state.run_chunk(
+            "assert(acc:deposit(5) == 15 and acc.balance == 15)\n"
+            "acc.balance = 20 acc.owner = 'bob'\n"
+            "assert(acc:describe() == 'bob: 20' and acc.id == 42)\n"
+            "assert(not pcall(function() acc.id = 1 end))\n"
+            "assert(not pcall(function() acc.missing = 1 end))\n"
+            "assert(acc.missing == nil)\n"
+            "local ok, err = pcall(acc.deposit, acc, -1) assert(not ok and err == 'deposit must be positive')\n"
+            "assert(not pcall(acc.deposit, 1, 1))\n"
+            "assert(not pcall(acc.deposit, acc, 'x'))\n"
+            "assert(acc.the_identifier_of_this_account_which_is_not_interned == 42)\n"
+            "assert(acc.the_identifier_of_this_account_which_is_not_interne == nil and acc[1] == nil)\n"
+            "for _, name in ipairs({ 'deposit', 'describe', 'balance', 'owner', 'id' }) do\n"
+            "    assert(acc[name .. ''] ~= nil and acc[name .. 'x'] == nil)\n"
+            "end\n"
+            "other = account.new('cat', 1)\n"
+            "assert(other:describe() == 'cat: 1')\n"
+        )));
+        ASSERT(acc.owner == "bob" && acc.balance == 20 && account::alive == 2);
+        SHOULD_THROW(state.get_object<account>("x"));
+        SHOULD_THROW(state.get_object<point>("acc"));
+        SHOULD_THROW(state.new_object<point>("p"));
+    }
+    state.run_chunk("acc, other, account = nil collectgarbage()");
+    ASSERT(account::alive == 0);
+
+    // registering C++ functions
+    state.register_function("hypot2", hypot2);
+    state.register_function("clamp", [](double x, double lo, double hi) { return x < lo ? lo : x > hi ? hi : x; });
+    state.register_function("split", [](const std::string &s, long long at) {
+        return std::make_tuple(s.substr(0, static_cast<std::size_t>(at)), s.substr(static_cast<std::size_t>(at)));
+    });
+    state.register_function("norm", [](point p) { return p.x * p.x + p.y * p.y; });
+    state.register_function("labeled_norm", [](std::string label, point p) { return label + ": " + std::to_string(p.x); });
+    state.register_function("fail", [](std::string msg) -> long long { throw std::runtime_error{msg}; });
+    {
+        static auto touched = 0;
+        state.register_function("touch", [] { ++touched; });
+        ASSERT(std::get<0>(state.run_chunk(
+            "assert(hypot2(3, 4) == 25)\n"
+            "assert(clamp(5, 0, 1) == 1 and clamp(-2, 0, 1) == 0)\n"
+            "local a, b = split('hello', 2) assert(a == 'he' and b == 'llo')\n"
+            "assert(norm({ x = 1, y = 2 }) == 5)\n"
+            "touch() touch()\n"
+            "local ok, err = pcall(fail, 'bad thing') assert(not ok and err == 'bad thing')\n"
+            "ok, err = pcall(hypot2, 3, 'x') assert(not ok and err:find('argument #2'))\n"
+            "ok, err = pcall(norm, 1) assert(not ok)\n"
+            "local lazy = setmetatable({}, { __index = function() error('no metamethods while converting') end })\n"
+            "ok, err = pcall(labeled_norm, 'p', lazy) assert(not ok and err:find('is not number'), err)\n"
+        )));
+        ASSERT(touched == 2);
+    }
+    state.run_chunk("hypot2, clamp, split, norm, labeled_norm, fail, touch = nil");
+
+    // tracebacks of errors
+    {
+        auto code = "local function inner() error('deep') end\n"
+                    "local function outer() inner() end\n"
+                    "outer()\n";
+        ASSERT(!std::get<0>(state.run_chunk(code)));
+        ASSERT(state.traceback().empty());
+        state.set_traceback(16);
+        auto ret = state.run_chunk(code);
+        ASSERT(!std::get<0>(ret) && std::get<1>(ret).find("deep") != std::string::npos);
+        auto trace = state.traceback();
+        ASSERT(trace.find("stack traceback:") == 0);
+        ASSERT(trace.find("[C]: in global 'error'") != std::string::npos);
+        ASSERT(trace.find(":1: in upvalue 'inner'") != std::string::npos);
+        ASSERT(trace.find(":2: in local 'outer'") != std::string::npos);
+        ASSERT(trace.find("in main chunk") != std::string::npos);
+        ASSERT(std::get<0>(state.run_chunk("x = x")) && state.traceback().empty());
+        state.run_chunk("function recurse(n) if n == 0 then error('bottom') end recurse(n - 1) end");
+        SHOULD_THROW(state.get_function("recurse").call<>(50));
+        trace = state.traceback();
+        ASSERT(std::count(trace.begin(), trace.end(), '\n') == 17 && trace.find("\n\t...") != std::string::npos);
+        state.call<>("tostring", 1);
+        ASSERT(state.traceback().empty());
+        state.set_traceback(0);
+        SHOULD_THROW(state.call<>("recurse", 1));
+        ASSERT(state.traceback().empty());
+        state.run_chunk("recurse = nil");
+    }
+
+    // coroutines
+    {
+        state.run_chunk(
+            "function counter(from, to)\n"
+            "    threads = (threads or 0) + 1 last = coroutine.running()\n"
+            "    local step = 1\n"
+            "    local i = from\n"
+            "    while i <= to do step = coroutine.yield(i, i * i) or step i = i + step end\n"
+            "    return 'done'\n"
+            "end\n"
+            "function broken(x) coroutine.yield(x) error('broken ' .. x) end\n"
+        );
+        auto co = state.new_coroutine("counter");
+        ASSERT(co.status() == co_status::SUSPENDED);
+        ASSERT(co.resume(1, 10) == co_status::SUSPENDED);
+        ASSERT(co.size() == 2 && co.get<long long>(1) == 1 && co.get<long long>(2) == 1);
+        ASSERT(co.resume(4) == co_status::SUSPENDED && co.get<int>(1) == 5 && co.get<double>(2) == 25.0);
+        ASSERT(co.resume() == co_status::SUSPENDED && co.get<int>(1) == 9);
+        ASSERT(co.resume() == co_status::DONE);
+        ASSERT(co.size() == 1 && co.get<std::string>(1) == "done");
+        SHOULD_THROW(co.get<std::string>(2));
+        SHOULD_THROW(co.resume());
+        co = state.new_coroutine("broken");
+        ASSERT(co.resume("x") == co_status::SUSPENDED && co.error().empty());
+        state.set_traceback(8);
+        ASSERT(co.resume() == co_status::ERROR && co.size() == 0);
+        ASSERT(co.error().find("broken x") != std::string::npos);
+        ASSERT(state.traceback().find("in function <") != std::string::npos);
+        state.set_traceback(0);
+        SHOULD_THROW(state.new_coroutine("x"));
+
+        // finished threads are reused, yielded ones are not
+        auto f = state.get_function("counter");
+        {
+            auto a = state.new_coroutine(f);
+            a.resume(1, 1);
+            a.resume();
+            ASSERT(a.status() == co_status::DONE);
+        }
+        state.run_chunk("first = last");
+        for (auto i = 0; i < 3; ++i) {
+            auto a = state.new_coroutine(f);
+            a.resume(1, 0);
+            ASSERT(a.status() == co_status::DONE);
+            ASSERT(std::get<0>(state.run_chunk("assert(last == first)")));
+        }
+        {
+            auto a = state.new_coroutine(f);
+            a.resume(1, 2);
+            ASSERT(std::get<0>(state.run_chunk("assert(last == first)")));
+        }
+        auto b = state.new_coroutine(f);
+        b.resume(1, 0);
+        ASSERT(std::get<0>(state.run_chunk("assert(last ~= first and threads == 7)")));
+        state.run_chunk("counter, broken, threads, last, first = nil");
+    }
+
     // move
     auto state2 = std::move(state);
     ASSERT(state2.get_global<types::INT>("x") == 15);
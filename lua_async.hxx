@@ -0,0 +1,355 @@
+#pragma once
+
+// C++20 coroutine layer, configure with -DLUAI_COROUTINES=ON to build with C++20
+// an async function registered with register_async() parks the lua coroutine calling it until the
+// C++ coroutine completes, and resume_async() lets a C++ coroutine await a lua coroutine calling
+// them. so one thread runs many scripts waiting for I/O, resumed by whatever completes the I/O
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <tuple>
+#include <utility>
+
+#include "lua_interpreter.hxx"
+
+namespace luai {
+
+template<class T = void>
+class async;
+
+namespace stack {
+    // a lua thread parked in an async function yields async_key, then the async_state of the function
+    inline const char async_key = 0;
+
+    // set by the code that resumed the parked thread, to learn when the async function completes
+    struct async_state {
+        // returns the coroutine to run next
+        std::coroutine_handle<> (*on_done)(void *waiter) noexcept = nullptr;
+        void *waiter = nullptr;
+    };
+
+    struct async_promise_base {
+        async_state state;
+        std::coroutine_handle<> continuation;
+        std::exception_ptr error;
+        // nothing waits for the result anymore, the frame destroys itself once it completes
+        bool detached = false;
+
+        // resumes the C++ coroutine awaiting the result, or lets the parked lua thread continue
+        struct final_awaiter {
+            bool detached;
+
+            bool await_ready() noexcept { return detached; }
+
+            template<class P>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+                auto &promise = h.promise();
+                if (promise.continuation)
+                    return promise.continuation;
+                // resuming the lua thread may destroy this frame, do not touch it afterwards
+                if (promise.state.on_done)
+                    return promise.state.on_done(promise.state.waiter);
+                return std::noop_coroutine();
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        final_awaiter final_suspend() noexcept { return {detached}; }
+        void unhandled_exception() noexcept { error = std::current_exception(); }
+
+        void detach() noexcept {
+            state = {};
+            continuation = {};
+            detached = true;
+        }
+    };
+
+    // destroys a completed frame. a pending one may be queued to be resumed, by a timer or some I/O,
+    // so it is detached instead and destroys itself at its final suspend
+    inline void release(std::coroutine_handle<> h, async_promise_base &promise) noexcept {
+        if (h.done())
+            h.destroy();
+        else
+            promise.detach();
+    }
+
+    template<class T>
+    struct async_promise : async_promise_base {
+        std::optional<T> value;
+
+        async<T> get_return_object() noexcept;
+
+        template<class U>
+        void return_value(U &&result) {
+            value.emplace(std::forward<U>(result));
+        }
+
+        T take() {
+            if (error)
+                std::rethrow_exception(error);
+            return std::move(*value);
+        }
+    };
+
+    template<>
+    struct async_promise<void> : async_promise_base {
+        async<void> get_return_object() noexcept;
+
+        void return_void() noexcept {}
+
+        void take() {
+            if (error)
+                std::rethrow_exception(error);
+        }
+    };
+
+    template<class R, class... Args>
+    struct async_trampoline;
+} // namespace stack
+
+// the result of an async function: a C++20 coroutine that starts at once. it can be awaited by
+// other coroutines, or registered with register_async() to be called from lua coroutines.
+// destroying it before it is done lets the coroutine finish on its own
+template<class T>
+class async {
+public:
+    using promise_type = stack::async_promise<T>;
+
+    explicit async(std::coroutine_handle<promise_type> h) noexcept : handle{h} {}
+
+    // MOVE
+    async(async &&other) noexcept : handle{std::exchange(other.handle, {})} {}
+    async &operator=(async &&other) noexcept {
+        if (this != &other) {
+            if (handle)
+                stack::release(handle, handle.promise());
+            handle = std::exchange(other.handle, {});
+        }
+        return *this;
+    }
+
+    // COPYING DELETED
+
+    ~async() {
+        if (handle)
+            stack::release(handle, handle.promise());
+    }
+
+    bool done() const noexcept { return handle.done(); }
+
+    // the result, or rethrows the exception of the coroutine. once, after done()
+    T get() { return handle.promise().take(); }
+
+    bool await_ready() const noexcept { return handle.done(); }
+    void await_suspend(std::coroutine_handle<> h) noexcept { handle.promise().continuation = h; }
+    T await_resume() { return get(); }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    template<class R, class... Args>
+    friend struct stack::async_trampoline;
+};
+
+namespace stack {
+    template<class T>
+    async<T> async_promise<T>::get_return_object() noexcept {
+        return async<T>{std::coroutine_handle<async_promise>::from_promise(*this)};
+    }
+
+    inline async<void> async_promise<void>::get_return_object() noexcept {
+        return async<void>{std::coroutine_handle<async_promise>::from_promise(*this)};
+    }
+
+    // the frame of an async function a lua thread is parked in, owned by a userdata on its stack.
+    // when the thread is collected first, the frame is released: it finishes on its own
+    struct async_frame {
+        std::coroutine_handle<> handle;
+        async_promise_base *promise;
+
+        ~async_frame() {
+            if (handle)
+                release(handle, *promise);
+        }
+    };
+
+    // like trampoline, for functions returning async<R>. when the result is not ready at once, the
+    // frame is kept in a userdata and the thread yields async_key and the async_state, the
+    // continuation pushes the result when the thread is resumed
+    template<class R, class... Args>
+    struct async_trampoline {
+        using pointer = async<R> (*)(Args...);
+        static constexpr int parked = -2;
+
+        static int call(lua_State *L) {
+            auto nresults = start(L);
+            if (nresults == parked)
+                return yield(L, 2, get_top(L) - 2, &resume);
+            return nresults >= 0 ? nresults : raise_error(L);
+        }
+
+        static int resume(lua_State *L, int, k_context frame_idx) {
+            auto nresults = finish(L, static_cast<int>(frame_idx));
+            return nresults >= 0 ? nresults : raise_error(L);
+        }
+
+        // returns the number of results, parked, or -1 with the error message pushed
+        static int start(lua_State *L) {
+            auto nresults = -1;
+            catch_to_message(L, [L, &nresults] {
+                if (!is_yieldable(L))
+                    throw luastate_error{"async function called outside a coroutine"};
+                // a pending frame must not be destroyed by a throw, so room is made first
+                reserve(L, 4);
+                auto fn = *static_cast<pointer *>(closure_data(L));
+                auto op = apply(L, fn, std::index_sequence_for<Args...>{});
+                if (op.done()) {
+                    nresults = push_result(L, op);
+                    return;
+                }
+                auto &promise = op.handle.promise();
+                new (new_object(L, &class_key<async_frame>::key, sizeof(async_frame))) async_frame{op.handle, &promise};
+                finish_object(L);
+                op.handle = {};
+                push_light(L, &async_key);
+                push_light(L, &promise.state);
+                nresults = parked;
+            });
+            return nresults;
+        }
+
+        static int finish(lua_State *L, int frame_idx) {
+            auto nresults = -1;
+            catch_to_message(L, [L, frame_idx, &nresults] {
+                auto frame = static_cast<async_frame *>(userdata_at(L, frame_idx));
+                auto h = std::coroutine_handle<async_promise<R>>::from_address(frame->handle.address());
+                if (!h.done())
+                    throw luastate_error{"coroutine resumed before its async function completed"};
+                frame->handle = {};
+                auto op = async<R>{h};
+                nresults = push_result(L, op);
+            });
+            return nresults;
+        }
+
+        template<std::size_t... I>
+        static async<R> apply(lua_State *L, pointer fn, std::index_sequence<I...>) {
+            return fn(value_traits<std::decay_t<Args>>::get(L, static_cast<int>(I) + 1, arg_name(static_cast<int>(I) + 1))...);
+        }
+
+        static int push_result(lua_State *L, async<R> &op) {
+            if constexpr (std::is_void_v<R>) {
+                op.get();
+                return 0;
+            } else {
+                return trampoline<R>::push_results(L, op.get());
+            }
+        }
+    };
+
+    template<class F>
+    struct async_traits : async_traits<decltype(&F::operator())> {};
+
+    template<class R, class... Args>
+    struct async_traits<async<R> (*)(Args...)> {
+        using pointer = async<R> (*)(Args...);
+        using trampoline_type = async_trampoline<R, Args...>;
+    };
+
+    template<class C, class R, class... Args>
+    struct async_traits<async<R> (C::*)(Args...) const> : async_traits<async<R> (*)(Args...)> {};
+
+    // resumes a lua coroutine, then again each time an async function it is parked in completes
+    template<class... Args>
+    struct resume_awaiter {
+        coroutine &co;
+        std::tuple<Args...> args;
+        std::coroutine_handle<> host;
+        std::exception_ptr error;
+
+        // the awaiting coroutine was destroyed while the lua thread is parked: the async function
+        // completes without resuming it, and the lua thread stays suspended
+        ~resume_awaiter() {
+            auto state = parked_in();
+            if (state && state->waiter == this)
+                *state = {};
+        }
+
+        bool await_ready() {
+            std::apply([this](const auto &... arg) { co.resume(arg...); }, args);
+            return !parked_in();
+        }
+
+        void await_suspend(std::coroutine_handle<> h) noexcept {
+            host = h;
+            wait(parked_in());
+        }
+
+        co_status await_resume() {
+            if (error)
+                std::rethrow_exception(error);
+            return co.status();
+        }
+
+        // the async function the lua thread is parked in, or nullptr
+        async_state *parked_in() const noexcept {
+            auto L = co.thread();
+            if (co.status() != co_status::SUSPENDED || co.size() != 2 || to_light(L, 1) != &async_key)
+                return nullptr;
+            return static_cast<async_state *>(to_light(L, 2));
+        }
+
+        void wait(async_state *state) noexcept {
+            state->on_done = &step;
+            state->waiter = this;
+        }
+
+        static std::coroutine_handle<> step(void *waiter) noexcept {
+            auto self = static_cast<resume_awaiter *>(waiter);
+            try {
+                self->co.resume();
+            } catch (...) {
+                self->error = std::current_exception();
+                return self->host;
+            }
+            if (auto state = self->parked_in()) {
+                self->wait(state);
+                return std::noop_coroutine();
+            }
+            return self->host;
+        }
+    };
+} // namespace stack
+
+// exposes a function or a lambda without captures returning async<R> as a global lua function,
+// e.g. register_async(state, "fetch", [](std::string url) -> async<std::string> { ... })
+// arguments and results are converted like register_function(). it can only be called from lua
+// coroutines: when the result is not ready at once, the coroutine yields to the code resuming it,
+// and continues with the result once resumed after the async function completed
+template<class F>
+void register_async(lua_interpreter &state, const char *name, F fn) {
+    using traits = stack::async_traits<std::decay_t<F>>;
+    using pointer = typename traits::pointer;
+    static_assert(std::is_convertible_v<F, pointer>, "only functions and lambdas without captures can be registered");
+    // registered once per interpreter, registering again would replace the metatable of live frames
+    if (!state.has_class<stack::async_frame>())
+        state.register_class<stack::async_frame>("async frame");
+    auto ptr = static_cast<pointer>(fn);
+    state.register_function(name, &traits::trampoline_type::call, &ptr, sizeof ptr);
+}
+
+// awaits a lua coroutine, e.g. auto status = co_await resume_async(co, request). it is resumed with
+// args and, each time it parks in an async function, the awaiting coroutine is suspended until the
+// function completes and the lua coroutine is resumed with the result. the await completes with the
+// status once the lua coroutine yields other values, returns or fails. co must outlive the await,
+// and the interpreter must only be used from one thread. if the awaiting coroutine is destroyed
+// while co is parked, co stays suspended and can be resumed by hand
+template<class... Args>
+stack::resume_awaiter<Args...> resume_async(coroutine &co, Args... args) {
+    return {co, {std::move(args)...}, {}, {}};
+}
+
+} // namespace luai
@@ -1,3 +1,13 @@
+#include <algorithm>
+#include <climits>
+#include <clocale>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+
 #include "lua.hpp"
 
 #include "lua_interpreter.hxx"
@@ -8,9 +18,11 @@ using namespace luai;
 // GLOBAL => variable is global
 // TABLE => field is from a table indexed by string
 // TABLE_INDEX => field is from a table/array indexed by int
+// TABLE_KEY => field is from a table indexed by a registered key
 // FUNC... => stuff comes from a function
+// PUSHED => value is already on the top of the stack, key is only its name
 enum class var_where {
-    GLOBAL, TABLE, TABLE_INDEX, FUNC1
+    GLOBAL, TABLE, TABLE_INDEX, TABLE_KEY, FUNC1, PUSHED
 };
 
 using LuaInt = long long;
@@ -21,11 +33,1840 @@ using keytype_t =
     std::conditional_t<VarWhere == var_where::GLOBAL, const char *,
     std::conditional_t<VarWhere == var_where::TABLE, const char *,
     std::conditional_t<VarWhere == var_where::TABLE_INDEX, LuaInt,
+    std::conditional_t<VarWhere == var_where::TABLE_KEY, const key_token &,
+    std::conditional_t<VarWhere == var_where::PUSHED, const char *,
                                 /*FUNC1*/ void (*)(lua_State *, int)
->>>;
+>>>>>;
+
+struct shared_value::table_data {
+    array_type array;
+    // sorted by key, so fields can be binary searched and iterated by position
+    std::vector<std::pair<std::string, shared_value>> fields;
+
+    // returns fields.size() if not found
+    size_t find(const char *key, size_t len) const noexcept {
+        auto it = std::lower_bound(fields.begin(), fields.end(), std::make_pair(key, len),
+            [](const auto &field, const auto &k) {
+                return field.first.compare(0, std::string::npos, k.first, k.second) < 0;
+            });
+        if (it == fields.end() || it->first.compare(0, std::string::npos, key, len) != 0)
+            return fields.size();
+        return static_cast<size_t>(it - fields.begin());
+    }
+};
+
+namespace {
+    constexpr int IGNORED {};
+
+    // userdata block of array_view
+    template<class T>
+    struct array_userdata {
+        T *data;
+        size_t size;
+        std::shared_ptr<T> owner;
+    };
+
+    template<class T>
+    struct array_meta;
+
+    template<> struct array_meta<double> { static constexpr const char *name = "array<double>"; };
+    template<> struct array_meta<float> { static constexpr const char *name = "array<float>"; };
+    template<> struct array_meta<std::int64_t> { static constexpr const char *name = "array<int64>"; };
+    template<> struct array_meta<std::int32_t> { static constexpr const char *name = "array<int32>"; };
+
+    template<class T>
+    std::enable_if_t<std::is_integral<T>::value> push_element(lua_State *L, T value) {
+        lua_pushinteger(L, static_cast<LuaInt>(value));
+    }
+    template<class T>
+    std::enable_if_t<std::is_floating_point<T>::value> push_element(lua_State *L, T value) {
+        lua_pushnumber(L, static_cast<lua_Number>(value));
+    }
+
+    template<class T>
+    std::enable_if_t<std::is_integral<T>::value, T> check_element(lua_State *L, int arg) {
+        return static_cast<T>(luaL_checkinteger(L, arg));
+    }
+    template<class T>
+    std::enable_if_t<std::is_floating_point<T>::value, T> check_element(lua_State *L, int arg) {
+        return static_cast<T>(luaL_checknumber(L, arg));
+    }
+
+    // metamethods keep the metatable as upvalue 1, so checking an argument is one comparison
+    // instead of a registry lookup by name
+    template<class T>
+    array_userdata<T> *check_array(lua_State *L, int arg) {
+        auto ud = static_cast<array_userdata<T> *>(lua_touserdata(L, arg));
+        if (ud == NULL || !lua_getmetatable(L, arg) || !lua_rawequal(L, -1, lua_upvalueindex(1)))
+            luaL_argerror(L, arg, array_meta<T>::name);
+        lua_pop(L, 1);
+        return ud;
+    }
+
+    // index from 1, yields nil outside the array like a table does
+    template<class T>
+    int array_index(lua_State *L) {
+        auto ud = check_array<T>(L, 1);
+        auto isnum = int{};
+        auto i = lua_tointegerx(L, 2, &isnum);
+        if (isnum && i >= 1 && static_cast<size_t>(i) <= ud->size)
+            push_element(L, ud->data[i - 1]);
+        else
+            lua_pushnil(L);
+        return 1;
+    }
+
+    template<class T>
+    int array_newindex(lua_State *L) {
+        auto ud = check_array<T>(L, 1);
+        auto i = luaL_checkinteger(L, 2);
+        luaL_argcheck(L, i >= 1 && static_cast<size_t>(i) <= ud->size, 2, "index out of range");
+        ud->data[i - 1] = check_element<T>(L, 3);
+        return 0;
+    }
+
+    template<class T>
+    int array_len(lua_State *L) {
+        lua_pushinteger(L, static_cast<LuaInt>(check_array<T>(L, 1)->size));
+        return 1;
+    }
+
+    // iterator of __pairs
+    template<class T>
+    int array_next(lua_State *L) {
+        auto ud = check_array<T>(L, 1);
+        auto i = luaL_checkinteger(L, 2) + 1;
+        if (i < 1 || static_cast<size_t>(i) > ud->size)
+            return 0;
+        lua_pushinteger(L, i);
+        push_element(L, ud->data[i - 1]);
+        return 2;
+    }
+
+    template<class T>
+    int array_pairs(lua_State *L) {
+        check_array<T>(L, 1);
+        lua_pushvalue(L, lua_upvalueindex(1));
+        lua_pushcclosure(L, array_next<T>, 1);
+        lua_pushvalue(L, 1);
+        lua_pushinteger(L, 0);
+        return 3;
+    }
+
+    template<class T>
+    int array_tostring(lua_State *L) {
+        auto ud = check_array<T>(L, 1);
+        lua_pushfstring(L, "%s: %p", array_meta<T>::name, static_cast<void *>(ud->data));
+        return 1;
+    }
+
+    template<class T>
+    int array_gc(lua_State *L) {
+        static_cast<array_userdata<T> *>(lua_touserdata(L, 1))->~array_userdata<T>();
+        return 0;
+    }
+
+    // the metatable is created once per state and stored in the registry under the address
+    // of its name
+    // pop 0, push 1
+    template<class T>
+    void push_array_meta(lua_State *L) {
+        if (lua_rawgetp(L, LUA_REGISTRYINDEX, array_meta<T>::name) != LUA_TNIL)
+            return;
+        lua_pop(L, 1);
+        static const luaL_Reg methods[] = {
+            {"__index", array_index<T>},
+            {"__newindex", array_newindex<T>},
+            {"__len", array_len<T>},
+            {"__pairs", array_pairs<T>},
+            {"__tostring", array_tostring<T>},
+            {"__gc", array_gc<T>},
+            {NULL, NULL}
+        };
+        lua_createtable(L, 0, 7);
+        lua_pushvalue(L, -1);
+        luaL_setfuncs(L, methods, 1);
+        lua_pushstring(L, array_meta<T>::name);
+        lua_setfield(L, -2, "__name");
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, array_meta<T>::name);
+    }
+
+    // userdata block of a shared_value table proxy
+    struct shared_proxy {
+        shared_value table;
+    };
+
+    // registry keys
+    constexpr char shared_meta_key {};
+    constexpr char shared_cache_key {};
+
+    const char *const shared_meta_name = "shared table";
+
+    const shared_value::table_data *check_shared(lua_State *L, int arg) {
+        auto ud = static_cast<shared_proxy *>(lua_touserdata(L, arg));
+        if (ud == NULL || !lua_getmetatable(L, arg) || !lua_rawequal(L, -1, lua_upvalueindex(1)))
+            luaL_argerror(L, arg, shared_meta_name);
+        lua_pop(L, 1);
+        return static_cast<const shared_value::table_data *>(ud->table.identity());
+    }
+
+    // integer keys index the array part, string keys the fields
+    // returns NULL if there is no such key
+    const shared_value *find_shared(lua_State *L, const shared_value::table_data *table, int keyidx) {
+        auto isint = int{};
+        auto type = lua_type(L, keyidx);
+        if (type == LUA_TNUMBER) {
+            auto i = lua_tointegerx(L, keyidx, &isint);
+            if (isint && i >= 1 && static_cast<size_t>(i) <= table->array.size())
+                return &table->array[static_cast<size_t>(i - 1)];
+        } else if (type == LUA_TSTRING) {
+            auto len = size_t{};
+            auto key = lua_tolstring(L, keyidx, &len);
+            auto pos = table->find(key, len);
+            if (pos != table->fields.size())
+                return &table->fields[pos].second;
+        }
+        return NULL;
+    }
+
+    int shared_index(lua_State *L) {
+        auto found = find_shared(L, check_shared(L, 1), 2);
+        if (found)
+            stack::push_shared(L, *found);
+        else
+            lua_pushnil(L);
+        return 1;
+    }
+
+    int shared_newindex(lua_State *L) {
+        check_shared(L, 1);
+        return luaL_error(L, "attempt to modify a read-only shared table");
+    }
+
+    int shared_len(lua_State *L) {
+        lua_pushinteger(L, static_cast<LuaInt>(check_shared(L, 1)->array.size()));
+        return 1;
+    }
+
+    // iterates the array part, then the fields. the position of a field key is found by binary search
+    int shared_next(lua_State *L) {
+        auto table = check_shared(L, 1);
+        auto nextpos = size_t{};
+        auto type = lua_type(L, 2);
+        if (type == LUA_TNIL) {
+            nextpos = 0;
+        } else if (type == LUA_TNUMBER) {
+            nextpos = static_cast<size_t>(luaL_checkinteger(L, 2));
+        } else {
+            auto len = size_t{};
+            auto key = luaL_checklstring(L, 2, &len);
+            auto pos = table->find(key, len);
+            luaL_argcheck(L, pos != table->fields.size(), 2, "invalid key to 'next'");
+            nextpos = table->array.size() + pos + 1;
+        }
+        if (nextpos < table->array.size()) {
+            lua_pushinteger(L, static_cast<LuaInt>(nextpos + 1));
+            stack::push_shared(L, table->array[nextpos]);
+            return 2;
+        }
+        auto fieldpos = nextpos - table->array.size();
+        if (fieldpos < table->fields.size()) {
+            const auto &field = table->fields[fieldpos];
+            lua_pushlstring(L, field.first.data(), field.first.size());
+            stack::push_shared(L, field.second);
+            return 2;
+        }
+        return 0;
+    }
+
+    int shared_pairs(lua_State *L) {
+        check_shared(L, 1);
+        lua_pushvalue(L, lua_upvalueindex(1));
+        lua_pushcclosure(L, shared_next, 1);
+        lua_pushvalue(L, 1);
+        lua_pushnil(L);
+        return 3;
+    }
+
+    int shared_gc(lua_State *L) {
+        static_cast<shared_proxy *>(lua_touserdata(L, 1))->~shared_proxy();
+        return 0;
+    }
+
+    // pop 0, push 1
+    void push_shared_meta(lua_State *L) {
+        if (lua_rawgetp(L, LUA_REGISTRYINDEX, &shared_meta_key) != LUA_TNIL)
+            return;
+        lua_pop(L, 1);
+        static const luaL_Reg methods[] = {
+            {"__index", shared_index},
+            {"__newindex", shared_newindex},
+            {"__len", shared_len},
+            {"__pairs", shared_pairs},
+            {"__gc", shared_gc},
+            {NULL, NULL}
+        };
+        lua_createtable(L, 0, 6);
+        lua_pushvalue(L, -1);
+        luaL_setfuncs(L, methods, 1);
+        lua_pushstring(L, shared_meta_name);
+        lua_setfield(L, -2, "__name");
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &shared_meta_key);
+    }
+
+    // proxies are cached weakly per table, so a table is always the same lua value
+    // pop 0, push 1
+    void push_shared_cache(lua_State *L) {
+        if (lua_rawgetp(L, LUA_REGISTRYINDEX, &shared_cache_key) != LUA_TNIL)
+            return;
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "v");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &shared_cache_key);
+    }
+
+    // the shared proxy at idx, or NULL if it is another userdata
+    // pop 0, push 0
+    shared_proxy *test_shared(lua_State *L, int idx) {
+        auto matches = false;
+        if (lua_getmetatable(L, idx)) {
+            push_shared_meta(L);
+            matches = lua_rawequal(L, -1, -2);
+            lua_pop(L, 2);
+        }
+        return matches ? static_cast<shared_proxy *>(lua_touserdata(L, idx)) : NULL;
+    }
+
+    // copies lua values into a shared_value tree. tables reached twice are shared, cycles are rejected
+    struct shared_builder {
+        lua_State *L;
+        std::unordered_map<const void *, shared_value> done;
+        std::unordered_set<const void *> visiting;
+
+        shared_value build(int idx, const char *name) {
+            switch (lua_type(L, idx)) {
+            case LUA_TNIL:
+                return {};
+            case LUA_TBOOLEAN:
+                return shared_value::boolean(lua_toboolean(L, idx));
+            case LUA_TNUMBER:
+                return lua_isinteger(L, idx) ? shared_value::integer(lua_tointeger(L, idx))
+                                             : shared_value::number(lua_tonumber(L, idx));
+            case LUA_TSTRING: {
+                auto len = size_t{};
+                auto str = lua_tolstring(L, idx, &len);
+                return shared_value::string({str, len});
+            }
+            case LUA_TTABLE:
+                return build_table(idx, name);
+            case LUA_TUSERDATA:
+                if (auto ud = test_shared(L, idx))
+                    return ud->table;
+                break;
+            }
+            throw luastate_error{std::string{"variable/field ["} + name + "] cannot be shared: unsupported type"};
+        }
+
+        shared_value build_table(int idx, const char *name) {
+            auto ptr = lua_topointer(L, idx);
+            auto found = done.find(ptr);
+            if (found != done.end())
+                return found->second;
+            if (!visiting.insert(ptr).second)
+                throw luastate_error{std::string{"variable/field ["} + name + "] cannot be shared: cyclic table"};
+            if (!lua_checkstack(L, 4))
+                throw luastate_error{"cannot grow Lua stack: out of memory"};
+            auto array = shared_value::array_type{};
+            auto fields = shared_value::fields_type{};
+            auto len = static_cast<LuaInt>(lua_rawlen(L, idx));
+            array.reserve(static_cast<size_t>(len));
+            for (auto i = LuaInt{1}; i <= len; ++i) {
+                lua_rawgeti(L, idx, i);
+                array.push_back(build(lua_gettop(L), name));
+                lua_pop(L, 1);
+            }
+            lua_pushnil(L);
+            while (lua_next(L, idx)) {
+                auto top = lua_gettop(L);
+                if (lua_type(L, top - 1) == LUA_TSTRING) {
+                    auto klen = size_t{};
+                    auto key = lua_tolstring(L, top - 1, &klen);
+                    fields.emplace(std::string{key, klen}, build(top, key));
+                } else if (!lua_isinteger(L, top - 1) || lua_tointeger(L, top - 1) < 1
+                           || lua_tointeger(L, top - 1) > len) {
+                    throw luastate_error{std::string{"variable/field ["} + name
+                        + "] cannot be shared: keys must be strings or array indices"};
+                }
+                lua_pop(L, 1);
+            }
+            visiting.erase(ptr);
+            auto result = shared_value::table(std::move(array), std::move(fields));
+            done.emplace(ptr, result);
+            return result;
+        }
+    };
+
+    // nested tables deeper than this are rejected, so malicious data cannot overflow the C stack
+    const int max_nesting = 200;
+
+    // counts the keys of the table at idx, and returns whether they are exactly 1..#t
+    // pop 0, push 0
+    bool is_sequence(lua_State *L, int idx, size_t &count) {
+        auto len = static_cast<LuaInt>(lua_rawlen(L, idx));
+        auto isarray = true;
+        count = 0;
+        lua_pushnil(L);
+        while (lua_next(L, idx)) {
+            ++count;
+            isarray = isarray && lua_isinteger(L, -2) && lua_tointeger(L, -2) >= 1
+                && lua_tointeger(L, -2) <= len;
+            lua_pop(L, 1);
+        }
+        return isarray && count == static_cast<size_t>(len);
+    }
+
+    // appends lua values to a buffer in the MessagePack format. tables are packed with raw access,
+    // as an array if their keys are exactly 1..#t, or as a map otherwise. cycles are rejected
+    struct msgpack_writer {
+        lua_State *L;
+        std::string &out;
+        std::unordered_set<const void *> visiting;
+
+        void put(unsigned char byte) {
+            out.push_back(static_cast<char>(byte));
+        }
+
+        // the tag, then the value in big endian
+        template<class U>
+        void put(unsigned char tag, U value) {
+            put(tag);
+            for (auto shift = static_cast<int>(sizeof(U) - 1) * 8; shift >= 0; shift -= 8)
+                put(static_cast<unsigned char>(value >> shift));
+        }
+
+        // fix is the tag of the short form holding up to fixmax elements, tag16 and tag32 follow each other
+        void put_size(size_t n, unsigned char fix, size_t fixmax, unsigned char tag16, const char *name) {
+            if (n <= fixmax)
+                put(static_cast<unsigned char>(fix | n));
+            else if (n <= 0xffff)
+                put(tag16, static_cast<std::uint16_t>(n));
+            else if (n <= 0xffffffff)
+                put(static_cast<unsigned char>(tag16 + 1), static_cast<std::uint32_t>(n));
+            else
+                throw luastate_error{std::string{"variable/field ["} + name + "] cannot be packed: too long"};
+        }
+
+        void pack_integer(LuaInt value) {
+            if (value >= 0) {
+                if (value < 128)
+                    put(static_cast<unsigned char>(value));
+                else if (value <= 0xff)
+                    put(0xcc, static_cast<std::uint8_t>(value));
+                else if (value <= 0xffff)
+                    put(0xcd, static_cast<std::uint16_t>(value));
+                else if (value <= 0xffffffff)
+                    put(0xce, static_cast<std::uint32_t>(value));
+                else
+                    put(0xcf, static_cast<std::uint64_t>(value));
+            } else {
+                if (value >= -32)
+                    put(static_cast<unsigned char>(value));
+                else if (value >= INT8_MIN)
+                    put(0xd0, static_cast<std::uint8_t>(value));
+                else if (value >= INT16_MIN)
+                    put(0xd1, static_cast<std::uint16_t>(value));
+                else if (value >= INT32_MIN)
+                    put(0xd2, static_cast<std::uint32_t>(value));
+                else
+                    put(0xd3, static_cast<std::uint64_t>(value));
+            }
+        }
+
+        // numbers that survive a round trip through float take 5 bytes instead of 9
+        void pack_number(double value) {
+            auto narrow = static_cast<float>(value);
+            if (static_cast<double>(narrow) == value) {
+                auto bits = std::uint32_t{};
+                std::memcpy(&bits, &narrow, sizeof bits);
+                put(0xca, bits);
+            } else {
+                auto bits = std::uint64_t{};
+                std::memcpy(&bits, &value, sizeof bits);
+                put(0xcb, bits);
+            }
+        }
+
+        void pack_string(const char *str, size_t len, const char *name) {
+            if (len < 32)
+                put(static_cast<unsigned char>(0xa0 | len));
+            else if (len <= 0xff)
+                put(0xd9, static_cast<std::uint8_t>(len));
+            else
+                put_size(len, 0xa0, 31, 0xda, name);
+            out.append(str, len);
+        }
+
+        void pack(int idx, const char *name, int depth = 0) {
+            switch (lua_type(L, idx)) {
+            case LUA_TNIL:
+                return put(0xc0);
+            case LUA_TBOOLEAN:
+                return put(lua_toboolean(L, idx) ? 0xc3 : 0xc2);
+            case LUA_TNUMBER:
+                if (lua_isinteger(L, idx))
+                    return pack_integer(lua_tointeger(L, idx));
+                return pack_number(lua_tonumber(L, idx));
+            case LUA_TSTRING: {
+                auto len = size_t{};
+                auto str = lua_tolstring(L, idx, &len);
+                return pack_string(str, len, name);
+            }
+            case LUA_TTABLE:
+                return pack_table(idx, name, depth + 1);
+            }
+            throw luastate_error{std::string{"variable/field ["} + name + "] cannot be packed: unsupported type "
+                + luaL_typename(L, idx)};
+        }
+
+        void pack_table(int idx, const char *name, int depth) {
+            auto ptr = lua_topointer(L, idx);
+            if (depth > max_nesting)
+                throw luastate_error{std::string{"variable/field ["} + name + "] cannot be packed: nested too deep"};
+            if (!visiting.insert(ptr).second)
+                throw luastate_error{std::string{"variable/field ["} + name + "] cannot be packed: cyclic table"};
+            if (!lua_checkstack(L, 3))
+                throw luastate_error{"cannot grow Lua stack: out of memory"};
+            auto count = size_t{};
+            if (is_sequence(L, idx, count)) {
+                put_size(count, 0x90, 15, 0xdc, name);
+                for (auto i = LuaInt{1}; i <= static_cast<LuaInt>(count); ++i) {
+                    lua_rawgeti(L, idx, i);
+                    pack(lua_gettop(L), name, depth);
+                    lua_pop(L, 1);
+                }
+            } else {
+                put_size(count, 0x80, 15, 0xde, name);
+                lua_pushnil(L);
+                while (lua_next(L, idx)) {
+                    auto top = lua_gettop(L);
+                    pack(top - 1, name, depth);
+                    pack(top, lua_type(L, top - 1) == LUA_TSTRING ? lua_tostring(L, top - 1) : name, depth);
+                    lua_pop(L, 1);
+                }
+            }
+            visiting.erase(ptr);
+        }
+    };
+
+    // pushes the value read from a MessagePack buffer. binary data becomes strings,
+    // extension types are rejected
+    struct msgpack_reader {
+        lua_State *L;
+        const unsigned char *pos;
+        const unsigned char *end;
+
+        [[noreturn]] void fail(const char *what) {
+            throw luastate_error{std::string{"cannot unpack: "} + what};
+        }
+
+        void need(size_t n) {
+            if (static_cast<size_t>(end - pos) < n)
+                fail("truncated data");
+        }
+
+        template<class U>
+        U take() {
+            need(sizeof(U));
+            auto value = U{};
+            for (auto i = size_t{}; i < sizeof(U); ++i)
+                value = static_cast<U>(value << 8 | *pos++);
+            return value;
+        }
+
+        // a claimed size is only trusted as far as the remaining data can hold it
+        int presize(size_t n) {
+            return static_cast<int>(std::min({n, static_cast<size_t>(end - pos), static_cast<size_t>(INT_MAX)}));
+        }
+
+        // pop 0, push 1
+        void unpack(int depth = 0) {
+            if (!lua_checkstack(L, 3))
+                fail("out of stack space");
+            auto tag = take<std::uint8_t>();
+            if (tag <= 0x7f)
+                return lua_pushinteger(L, tag);
+            if (tag >= 0xe0)
+                return lua_pushinteger(L, static_cast<std::int8_t>(tag));
+            if (tag >= 0xa0 && tag <= 0xbf)
+                return unpack_string(tag & 0x1f);
+            if (tag >= 0x90 && tag <= 0x9f)
+                return unpack_array(tag & 0x0f, depth + 1);
+            if (tag >= 0x80 && tag <= 0x8f)
+                return unpack_map(tag & 0x0f, depth + 1);
+            switch (tag) {
+            case 0xc0: return lua_pushnil(L);
+            case 0xc2: return lua_pushboolean(L, 0);
+            case 0xc3: return lua_pushboolean(L, 1);
+            case 0xc4: case 0xd9: return unpack_string(take<std::uint8_t>());
+            case 0xc5: case 0xda: return unpack_string(take<std::uint16_t>());
+            case 0xc6: case 0xdb: return unpack_string(take<std::uint32_t>());
+            case 0xca: {
+                auto bits = take<std::uint32_t>();
+                auto value = float{};
+                std::memcpy(&value, &bits, sizeof value);
+                return lua_pushnumber(L, value);
+            }
+            case 0xcb: {
+                auto bits = take<std::uint64_t>();
+                auto value = double{};
+                std::memcpy(&value, &bits, sizeof value);
+                return lua_pushnumber(L, value);
+            }
+            case 0xcc: return lua_pushinteger(L, take<std::uint8_t>());
+            case 0xcd: return lua_pushinteger(L, take<std::uint16_t>());
+            case 0xce: return lua_pushinteger(L, take<std::uint32_t>());
+            case 0xcf: {
+                // lua integers are signed, larger values become numbers
+                auto value = take<std::uint64_t>();
+                if (value > static_cast<std::uint64_t>(LLONG_MAX))
+                    return lua_pushnumber(L, static_cast<double>(value));
+                return lua_pushinteger(L, static_cast<LuaInt>(value));
+            }
+            case 0xd0: return lua_pushinteger(L, static_cast<std::int8_t>(take<std::uint8_t>()));
+            case 0xd1: return lua_pushinteger(L, static_cast<std::int16_t>(take<std::uint16_t>()));
+            case 0xd2: return lua_pushinteger(L, static_cast<std::int32_t>(take<std::uint32_t>()));
+            case 0xd3: return lua_pushinteger(L, static_cast<LuaInt>(take<std::uint64_t>()));
+            case 0xdc: return unpack_array(take<std::uint16_t>(), depth + 1);
+            case 0xdd: return unpack_array(take<std::uint32_t>(), depth + 1);
+            case 0xde: return unpack_map(take<std::uint16_t>(), depth + 1);
+            case 0xdf: return unpack_map(take<std::uint32_t>(), depth + 1);
+            }
+            fail("unsupported type tag");
+        }
+
+        void unpack_string(size_t len) {
+            need(len);
+            lua_pushlstring(L, reinterpret_cast<const char *>(pos), len);
+            pos += len;
+        }
+
+        void unpack_array(size_t n, int depth) {
+            if (depth > max_nesting)
+                fail("nested too deep");
+            lua_createtable(L, presize(n), 0);
+            for (auto i = size_t{1}; i <= n; ++i) {
+                unpack(depth);
+                lua_rawseti(L, -2, static_cast<LuaInt>(i));
+            }
+        }
+
+        void unpack_map(size_t n, int depth) {
+            if (depth > max_nesting)
+                fail("nested too deep");
+            lua_createtable(L, 0, presize(n));
+            for (auto i = size_t{}; i < n; ++i) {
+                unpack(depth);
+                if (lua_isnil(L, -1) || (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) != lua_tonumber(L, -1)))
+                    fail("invalid table key");
+                unpack(depth);
+                lua_rawset(L, -3);
+            }
+        }
+
+        // the whole buffer must be one value
+        // pop 0, push 1
+        void unpack_all() {
+            unpack();
+            if (pos != end)
+                fail("trailing data");
+        }
+    };
+
+    // appends the value at idx to buf. on error buf is left unchanged
+    // pop 0, push 0
+    void pack_value(lua_State *L, int idx, std::string &buf, const char *name) {
+        auto top = lua_gettop(L);
+        auto size = buf.size();
+        try {
+            msgpack_writer{L, buf, {}}.pack(idx, name);
+        } catch (...) {
+            lua_settop(L, top);
+            buf.resize(size);
+            throw;
+        }
+    }
+
+    // pop 0, push 1
+    void unpack_value(lua_State *L, const char *data, size_t len) {
+        auto top = lua_gettop(L);
+        auto begin = reinterpret_cast<const unsigned char *>(data);
+        try {
+            msgpack_reader{L, begin, begin + len}.unpack_all();
+        } catch (...) {
+            lua_settop(L, top);
+            throw;
+        }
+    }
+
+    int msgpack_pack(lua_State *L) {
+        luaL_checkany(L, 1);
+        lua_settop(L, 1);
+        auto ok = stack::catch_to_message(L, [L] {
+            auto buf = std::string{};
+            pack_value(L, 1, buf, "argument");
+            lua_pushlstring(L, buf.data(), buf.size());
+        });
+        return ok ? 1 : lua_error(L);
+    }
+
+    int msgpack_unpack(lua_State *L) {
+        auto len = size_t{};
+        auto data = luaL_checklstring(L, 1, &len);
+        lua_settop(L, 1);
+        auto ok = stack::catch_to_message(L, [L, data, len] { unpack_value(L, data, len); });
+        return ok ? 1 : lua_error(L);
+    }
+
+    int open_msgpack_module(lua_State *L) {
+        static const luaL_Reg functions[] = {
+            {"pack", msgpack_pack},
+            {"unpack", msgpack_unpack},
+            {NULL, NULL}
+        };
+        luaL_newlib(L, functions);
+        return 1;
+    }
+
+    // shortest decimal digits of a double that read back the same, with Grisu2 (Loitsch, "Printing
+    // floating-point numbers quickly and accurately with integers"). the digits always read back the
+    // same, and are the shortest for all but a few values. nothing depends on the locale
+
+    // f * 2^e
+    struct diy_fp {
+        std::uint64_t f;
+        int e;
+    };
+
+    // same exponents, x.f >= y.f
+    diy_fp fp_sub(diy_fp x, diy_fp y) noexcept {
+        return {x.f - y.f, x.e};
+    }
+
+    // the 128-bit product rounded to its upper 64 bits
+    diy_fp fp_mul(diy_fp x, diy_fp y) noexcept {
+        const std::uint64_t low = 0xffffffff;
+        auto p0 = (x.f & low) * (y.f & low);
+        auto p1 = (x.f & low) * (y.f >> 32);
+        auto p2 = (x.f >> 32) * (y.f & low);
+        auto p3 = (x.f >> 32) * (y.f >> 32);
+        auto mid = (p0 >> 32) + (p1 & low) + (p2 & low) + (std::uint64_t{1} << 31);
+        return {p3 + (p1 >> 32) + (p2 >> 32) + (mid >> 32), x.e + y.e + 64};
+    }
+
+    // x.f is not 0
+    diy_fp fp_normalize(diy_fp x) noexcept {
+        while (!(x.f >> 63)) {
+            x.f <<= 1;
+            --x.e;
+        }
+        return x;
+    }
+
+    // 10^k as f * 2^e, rounded
+    struct cached_power {
+        std::uint64_t f;
+        int e;
+        int k;
+    };
+
+    // k from -300 to 324 in steps of 8
+    const cached_power cached_powers[] = {
+            {0xab70fe17c79ac6ca, -1060, -300},
+            {0xff77b1fcbebcdc4f, -1034, -292},
+            {0xbe5691ef416bd60c, -1007, -284},
+            {0x8dd01fad907ffc3c, -980, -276},
+            {0xd3515c2831559a83, -954, -268},
+            {0x9d71ac8fada6c9b5, -927, -260},
+            {0xea9c227723ee8bcb, -901, -252},
+            {0xaecc49914078536d, -874, -244},
+            {0x823c12795db6ce57, -847, -236},
+            {0xc21094364dfb5637, -821, -228},
+            {0x9096ea6f3848984f, -794, -220},
+            {0xd77485cb25823ac7, -768, -212},
+            {0xa086cfcd97bf97f4, -741, -204},
+            {0xef340a98172aace5, -715, -196},
+            {0xb23867fb2a35b28e, -688, -188},
+            {0x84c8d4dfd2c63f3b, -661, -180},
+            {0xc5dd44271ad3cdba, -635, -172},
+            {0x936b9fcebb25c996, -608, -164},
+            {0xdbac6c247d62a584, -582, -156},
+            {0xa3ab66580d5fdaf6, -555, -148},
+            {0xf3e2f893dec3f126, -529, -140},
+            {0xb5b5ada8aaff80b8, -502, -132},
+            {0x87625f056c7c4a8b, -475, -124},
+            {0xc9bcff6034c13053, -449, -116},
+            {0x964e858c91ba2655, -422, -108},
+            {0xdff9772470297ebd, -396, -100},
+            {0xa6dfbd9fb8e5b88f, -369, -92},
+            {0xf8a95fcf88747d94, -343, -84},
+            {0xb94470938fa89bcf, -316, -76},
+            {0x8a08f0f8bf0f156b, -289, -68},
+            {0xcdb02555653131b6, -263, -60},
+            {0x993fe2c6d07b7fac, -236, -52},
+            {0xe45c10c42a2b3b06, -210, -44},
+            {0xaa242499697392d3, -183, -36},
+            {0xfd87b5f28300ca0e, -157, -28},
+            {0xbce5086492111aeb, -130, -20},
+            {0x8cbccc096f5088cc, -103, -12},
+            {0xd1b71758e219652c, -77, -4},
+            {0x9c40000000000000, -50, 4},
+            {0xe8d4a51000000000, -24, 12},
+            {0xad78ebc5ac620000, 3, 20},
+            {0x813f3978f8940984, 30, 28},
+            {0xc097ce7bc90715b3, 56, 36},
+            {0x8f7e32ce7bea5c70, 83, 44},
+            {0xd5d238a4abe98068, 109, 52},
+            {0x9f4f2726179a2245, 136, 60},
+            {0xed63a231d4c4fb27, 162, 68},
+            {0xb0de65388cc8ada8, 189, 76},
+            {0x83c7088e1aab65db, 216, 84},
+            {0xc45d1df942711d9a, 242, 92},
+            {0x924d692ca61be758, 269, 100},
+            {0xda01ee641a708dea, 295, 108},
+            {0xa26da3999aef774a, 322, 116},
+            {0xf209787bb47d6b85, 348, 124},
+            {0xb454e4a179dd1877, 375, 132},
+            {0x865b86925b9bc5c2, 402, 140},
+            {0xc83553c5c8965d3d, 428, 148},
+            {0x952ab45cfa97a0b3, 455, 156},
+            {0xde469fbd99a05fe3, 481, 164},
+            {0xa59bc234db398c25, 508, 172},
+            {0xf6c69a72a3989f5c, 534, 180},
+            {0xb7dcbf5354e9bece, 561, 188},
+            {0x88fcf317f22241e2, 588, 196},
+            {0xcc20ce9bd35c78a5, 614, 204},
+            {0x98165af37b2153df, 641, 212},
+            {0xe2a0b5dc971f303a, 667, 220},
+            {0xa8d9d1535ce3b396, 694, 228},
+            {0xfb9b7cd9a4a7443c, 720, 236},
+            {0xbb764c4ca7a44410, 747, 244},
+            {0x8bab8eefb6409c1a, 774, 252},
+            {0xd01fef10a657842c, 800, 260},
+            {0x9b10a4e5e9913129, 827, 268},
+            {0xe7109bfba19c0c9d, 853, 276},
+            {0xac2820d9623bf429, 880, 284},
+            {0x80444b5e7aa7cf85, 907, 292},
+            {0xbf21e44003acdd2d, 933, 300},
+            {0x8e679c2f5e44ff8f, 960, 308},
+            {0xd433179d9c8cb841, 986, 316},
+            {0x9e19db92b4e31ba9, 1013, 324},
+    };
+
+    // the power that brings the exponent of a product with a number of binary exponent e to [-60, -32]
+    const cached_power &cached_power_for(int e) noexcept {
+        auto f = -60 - e - 1;
+        auto k = f * 78913 / (1 << 18) + (f > 0 ? 1 : 0);
+        return cached_powers[(300 + k + 7) / 8];
+    }
+
+    // moves the last digit closer to w as long as it stays within the boundaries
+    void round_digits(char *digits, int len, std::uint64_t dist, std::uint64_t delta, std::uint64_t rest,
+            std::uint64_t ten_k) noexcept {
+        while (rest < dist && delta - rest >= ten_k && (rest + ten_k < dist || dist - rest > rest + ten_k - dist)) {
+            --digits[len - 1];
+            rest += ten_k;
+        }
+    }
+
+    // the digits of high until the number is within (low, high), adds their exponent
+    int generate_digits(char *digits, int &exponent, diy_fp low, diy_fp w, diy_fp high) noexcept {
+        auto delta = fp_sub(high, low).f;
+        auto dist = fp_sub(high, w).f;
+        auto one = diy_fp{std::uint64_t{1} << -high.e, high.e};
+        auto p1 = static_cast<std::uint32_t>(high.f >> -one.e);
+        auto p2 = high.f & (one.f - 1);
+        auto len = 0;
+        // the integral part, p1 > 0
+        auto pow10 = std::uint32_t{1000000000};
+        auto n = 10;
+        while (pow10 > p1) {
+            pow10 /= 10;
+            --n;
+        }
+        while (n > 0) {
+            digits[len++] = static_cast<char>('0' + p1 / pow10);
+            p1 %= pow10;
+            --n;
+            auto rest = (std::uint64_t{p1} << -one.e) + p2;
+            if (rest <= delta) {
+                exponent += n;
+                round_digits(digits, len, dist, delta, rest, std::uint64_t{pow10} << -one.e);
+                return len;
+            }
+            pow10 /= 10;
+        }
+        // the fractional part
+        auto m = 0;
+        do {
+            p2 *= 10;
+            digits[len++] = static_cast<char>('0' + (p2 >> -one.e));
+            p2 &= one.f - 1;
+            ++m;
+            delta *= 10;
+            dist *= 10;
+        } while (p2 > delta);
+        exponent -= m;
+        round_digits(digits, len, dist, delta, p2, one.f);
+        return len;
+    }
+
+    // value is finite and > 0. returns the number of digits, at most 17: value = digits * 10^exponent
+    int shortest_digits(double value, char *digits, int &exponent) noexcept {
+        std::uint64_t bits;
+        std::memcpy(&bits, &value, sizeof bits);
+        auto biased = static_cast<int>(bits >> 52);
+        auto fraction = bits & ((std::uint64_t{1} << 52) - 1);
+        auto v = biased == 0 ? diy_fp{fraction, 1 - 1075} : diy_fp{fraction | std::uint64_t{1} << 52, biased - 1075};
+        // halfway to the neighbours, the one below is closer at powers of 2
+        auto high = fp_normalize({2 * v.f + 1, v.e - 1});
+        auto low = fraction == 0 && biased > 1 ? diy_fp{4 * v.f - 1, v.e - 2} : diy_fp{2 * v.f - 1, v.e - 1};
+        low = {low.f << (low.e - high.e), high.e};
+        auto &c = cached_power_for(high.e);
+        auto scale = diy_fp{c.f, c.e};
+        auto w = fp_mul(fp_normalize(v), scale);
+        low = fp_mul(low, scale);
+        high = fp_mul(high, scale);
+        // the scaled boundaries are off by up to one unit, stay inside them
+        ++low.f;
+        --high.f;
+        exponent = -c.k;
+        return generate_digits(digits, exponent, low, w, high);
+    }
+
+    // the doubles 10^0 to 10^22, all exact
+    const double exact_powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    // appends lua values to a buffer as JSON. tables are read with raw access, and written as arrays
+    // if their keys are exactly 1..#t, or as objects with string or number keys otherwise.
+    // json null is the NULL light userdata. cycles, NaN and infinities are rejected
+    struct json_writer {
+        lua_State *L;
+        std::string &out;
+        std::unordered_set<const void *> visiting;
+
+        void write_integer(LuaInt value) {
+            char digits[24];
+            auto end = digits + sizeof digits;
+            auto p = end;
+            auto magnitude = value < 0 ? 0 - static_cast<std::uint64_t>(value) : static_cast<std::uint64_t>(value);
+            do {
+                *--p = static_cast<char>('0' + magnitude % 10);
+                magnitude /= 10;
+            } while (magnitude);
+            if (value < 0)
+                *--p = '-';
+            out.append(p, end);
+        }
+
+        // the shortest digits that read back the same, like %g with a '.' whatever the locale. numbers
+        // that look like integers get a ".0", so they are decoded as floats again
+        void write_number(double value, const char *name) {
+            if (value != value || value - value != 0)
+                throw luastate_error{std::string{"variable/field ["} + name + "] cannot be encoded: not finite"};
+            if (std::signbit(value)) {
+                out.push_back('-');
+                value = -value;
+            }
+            if (value == 0) {
+                out.append("0.0");
+                return;
+            }
+            char digits[32];
+            auto exponent = 0;
+            auto len = shortest_digits(value, digits, exponent);
+            // where the decimal point goes after the first digits
+            auto point = len + exponent;
+            if (exponent >= 0 && point <= 17) {
+                out.append(digits, static_cast<size_t>(len));
+                out.append(static_cast<size_t>(exponent), '0');
+                out.append(".0");
+            } else if (point > 0 && point <= 17) {
+                out.append(digits, static_cast<size_t>(point));
+                out.push_back('.');
+                out.append(digits + point, static_cast<size_t>(len - point));
+            } else if (point > -4 && point <= 0) {
+                out.append("0.");
+                out.append(static_cast<size_t>(-point), '0');
+                out.append(digits, static_cast<size_t>(len));
+            } else {
+                out.push_back(digits[0]);
+                if (len > 1) {
+                    out.push_back('.');
+                    out.append(digits + 1, static_cast<size_t>(len - 1));
+                }
+                auto e = point - 1;
+                out.append(e < 0 ? "e-" : "e+");
+                if (e > -10 && e < 10)
+                    out.push_back('0');
+                write_integer(e < 0 ? -e : e);
+            }
+        }
+
+        // only '"', '\\' and control characters are escaped, the rest is copied in runs
+        void write_string(const char *str, size_t len) {
+            static const char hex[] = "0123456789abcdef";
+            out.push_back('"');
+            auto run = str;
+            for (auto p = str; p != str + len; ++p) {
+                auto c = static_cast<unsigned char>(*p);
+                if (c >= 0x20 && c != '"' && c != '\\')
+                    continue;
+                out.append(run, p);
+                run = p + 1;
+                out.push_back('\\');
+                switch (c) {
+                case '"': out.push_back('"'); break;
+                case '\\': out.push_back('\\'); break;
+                case '\n': out.push_back('n'); break;
+                case '\r': out.push_back('r'); break;
+                case '\t': out.push_back('t'); break;
+                case '\b': out.push_back('b'); break;
+                case '\f': out.push_back('f'); break;
+                default:
+                    out.append("u00");
+                    out.push_back(hex[c >> 4]);
+                    out.push_back(hex[c & 0xf]);
+                }
+            }
+            out.append(run, str + len);
+            out.push_back('"');
+        }
+
+        void write(int idx, const char *name, int depth = 0) {
+            switch (lua_type(L, idx)) {
+            case LUA_TNIL:
+                out.append("null");
+                return;
+            case LUA_TBOOLEAN:
+                out.append(lua_toboolean(L, idx) ? "true" : "false");
+                return;
+            case LUA_TNUMBER:
+                if (lua_isinteger(L, idx))
+                    return write_integer(lua_tointeger(L, idx));
+                return write_number(lua_tonumber(L, idx), name);
+            case LUA_TSTRING: {
+                auto len = size_t{};
+                auto str = lua_tolstring(L, idx, &len);
+                return write_string(str, len);
+            }
+            case LUA_TTABLE:
+                return write_table(idx, name, depth + 1);
+            case LUA_TLIGHTUSERDATA:
+                if (lua_touserdata(L, idx) != NULL)
+                    break;
+                out.append("null");
+                return;
+            }
+            throw luastate_error{std::string{"variable/field ["} + name + "] cannot be encoded: unsupported type "
+                + luaL_typename(L, idx)};
+        }
+
+        // keys are not converted with lua_tolstring(), which would confuse lua_next()
+        void write_key(int idx, const char *name) {
+            switch (lua_type(L, idx)) {
+            case LUA_TSTRING: {
+                auto len = size_t{};
+                auto str = lua_tolstring(L, idx, &len);
+                return write_string(str, len);
+            }
+            case LUA_TNUMBER:
+                out.push_back('"');
+                if (lua_isinteger(L, idx))
+                    write_integer(lua_tointeger(L, idx));
+                else
+                    write_number(lua_tonumber(L, idx), name);
+                out.push_back('"');
+                return;
+            }
+            throw luastate_error{std::string{"variable/field ["} + name
+                + "] cannot be encoded: keys must be strings or numbers"};
+        }
+
+        void write_table(int idx, const char *name, int depth) {
+            auto ptr = lua_topointer(L, idx);
+            if (depth > max_nesting)
+                throw luastate_error{std::string{"variable/field ["} + name + "] cannot be encoded: nested too deep"};
+            if (!visiting.insert(ptr).second)
+                throw luastate_error{std::string{"variable/field ["} + name + "] cannot be encoded: cyclic table"};
+            if (!lua_checkstack(L, 3))
+                throw luastate_error{"cannot grow Lua stack: out of memory"};
+            auto count = size_t{};
+            if (is_sequence(L, idx, count)) {
+                out.push_back('[');
+                for (auto i = LuaInt{1}; i <= static_cast<LuaInt>(count); ++i) {
+                    if (i > 1)
+                        out.push_back(',');
+                    lua_rawgeti(L, idx, i);
+                    write(lua_gettop(L), name, depth);
+                    lua_pop(L, 1);
+                }
+                out.push_back(']');
+            } else {
+                out.push_back('{');
+                auto first = true;
+                lua_pushnil(L);
+                while (lua_next(L, idx)) {
+                    auto top = lua_gettop(L);
+                    if (!first)
+                        out.push_back(',');
+                    first = false;
+                    write_key(top - 1, name);
+                    out.push_back(':');
+                    write(top, lua_type(L, top - 1) == LUA_TSTRING ? lua_tostring(L, top - 1) : name, depth);
+                    lua_pop(L, 1);
+                }
+                out.push_back('}');
+            }
+            visiting.erase(ptr);
+        }
+    };
+
+    // containers are collected on the stack this many elements at a time, so the tables of
+    // smaller ones are created with their final size
+    const int json_batch = 32;
+
+    // pushes the value read from JSON text. null becomes the NULL light userdata
+    struct json_reader {
+        lua_State *L;
+        const char *begin;
+        const char *pos;
+        const char *end;
+
+        [[noreturn]] void fail(const char *what) {
+            throw luastate_error{std::string{"cannot decode JSON: "} + what + " at offset "
+                + std::to_string(pos - begin)};
+        }
+
+        void skip_space() {
+            while (pos != end && (*pos == ' ' || *pos == '\n' || *pos == '\r' || *pos == '\t'))
+                ++pos;
+        }
+
+        bool consume(char c) {
+            skip_space();
+            if (pos == end || *pos != c)
+                return false;
+            ++pos;
+            return true;
+        }
+
+        void literal(const char *word, size_t len) {
+            if (static_cast<size_t>(end - pos) < len || std::memcmp(pos, word, len) != 0)
+                fail("invalid literal");
+            pos += len;
+        }
+
+        // pop 0, push 1
+        void decode(int depth = 0) {
+            skip_space();
+            if (pos == end)
+                fail("unexpected end");
+            if (!lua_checkstack(L, 3))
+                fail("out of stack space");
+            switch (*pos) {
+            case '{':
+                ++pos;
+                return decode_object(depth + 1);
+            case '[':
+                ++pos;
+                return decode_array(depth + 1);
+            case '"':
+                ++pos;
+                return decode_string();
+            case 't':
+                literal("true", 4);
+                return lua_pushboolean(L, 1);
+            case 'f':
+                literal("false", 5);
+                return lua_pushboolean(L, 0);
+            case 'n':
+                literal("null", 4);
+                return lua_pushlightuserdata(L, NULL);
+            }
+            decode_number();
+        }
+
+        bool at_digit() const {
+            return pos != end && *pos >= '0' && *pos <= '9';
+        }
+
+        // -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)? as in RFC 8259. integers that fit are pushed
+        // as lua integers. floats whose digits fit in 53 bits, with exponents up to 22, are computed
+        // exactly. the others are read by strtod() with the decimal point of the locale
+        void decode_number() {
+            auto start = pos;
+            auto negative = pos != end && *pos == '-';
+            if (negative)
+                ++pos;
+            if (!at_digit())
+                fail("invalid value");
+            // the number is significand * 10^exponent, the significand keeps 19 digits
+            auto significand = std::uint64_t{};
+            auto kept = 0;
+            auto exponent = 0;
+            auto inexact = false;
+            auto take_digit = [&] {
+                if (kept == 19) {
+                    inexact = inexact || *pos != '0';
+                    return false;
+                }
+                significand = significand * 10 + static_cast<std::uint64_t>(*pos - '0');
+                // leading zeros do not count
+                kept += significand != 0;
+                return true;
+            };
+            if (*pos == '0') {
+                ++pos;
+                if (at_digit())
+                    fail("invalid number: leading zero");
+            } else {
+                for (; at_digit(); ++pos)
+                    exponent += take_digit() ? 0 : 1;
+            }
+            auto isfloat = false;
+            if (pos != end && *pos == '.') {
+                isfloat = true;
+                ++pos;
+                if (!at_digit())
+                    fail("invalid number: no digits after the decimal point");
+                for (; at_digit(); ++pos)
+                    exponent -= take_digit() ? 1 : 0;
+            }
+            if (pos != end && (*pos == 'e' || *pos == 'E')) {
+                isfloat = true;
+                ++pos;
+                auto minus = pos != end && *pos == '-';
+                if (pos != end && (*pos == '+' || *pos == '-'))
+                    ++pos;
+                if (!at_digit())
+                    fail("invalid number: no digits in the exponent");
+                // large enough for any double, without overflowing
+                auto e = 0;
+                for (; at_digit(); ++pos)
+                    e = e < 100000 ? e * 10 + (*pos - '0') : e;
+                exponent += minus ? -e : e;
+            }
+            auto limit = static_cast<std::uint64_t>(LLONG_MAX) + (negative ? 1 : 0);
+            if (!isfloat && exponent == 0 && significand <= limit)
+                return lua_pushinteger(L, negative ? static_cast<LuaInt>(0 - significand) : static_cast<LuaInt>(significand));
+            if (!inexact && significand <= std::uint64_t{1} << 53 && exponent >= -22 && exponent <= 22) {
+                // one correctly rounded operation on exact operands
+                auto value = static_cast<double>(significand);
+                value = exponent < 0 ? value / exact_powers[-exponent] : value * exact_powers[exponent];
+                return lua_pushnumber(L, negative ? -value : value);
+            }
+            // strtod() needs a terminated string, with the decimal point of the locale, which may take
+            // several bytes
+            auto token = std::string{start, pos};
+            auto point = token.find('.');
+            if (point != std::string::npos)
+                token.replace(point, 1, std::localeconv()->decimal_point);
+            lua_pushnumber(L, std::strtod(token.c_str(), NULL));
+        }
+
+        void put_utf8(std::string &out, unsigned long code) {
+            if (code < 0x80) {
+                out.push_back(static_cast<char>(code));
+            } else if (code < 0x800) {
+                out.push_back(static_cast<char>(0xc0 | code >> 6));
+                out.push_back(static_cast<char>(0x80 | (code & 0x3f)));
+            } else if (code < 0x10000) {
+                out.push_back(static_cast<char>(0xe0 | code >> 12));
+                out.push_back(static_cast<char>(0x80 | (code >> 6 & 0x3f)));
+                out.push_back(static_cast<char>(0x80 | (code & 0x3f)));
+            } else {
+                out.push_back(static_cast<char>(0xf0 | code >> 18));
+                out.push_back(static_cast<char>(0x80 | (code >> 12 & 0x3f)));
+                out.push_back(static_cast<char>(0x80 | (code >> 6 & 0x3f)));
+                out.push_back(static_cast<char>(0x80 | (code & 0x3f)));
+            }
+        }
+
+        unsigned long hex4() {
+            if (end - pos < 4)
+                fail("truncated escape");
+            auto code = 0ul;
+            for (auto i = 0; i < 4; ++i, ++pos) {
+                auto c = *pos;
+                auto digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                    : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+                if (digit < 0)
+                    fail("invalid escape");
+                code = code << 4 | static_cast<unsigned long>(digit);
+            }
+            return code;
+        }
+
+        // strings without escapes are pushed straight from the input
+        void decode_string() {
+            auto run = pos;
+            while (pos != end && *pos != '"' && *pos != '\\' && static_cast<unsigned char>(*pos) >= 0x20)
+                ++pos;
+            if (pos != end && *pos == '"') {
+                lua_pushlstring(L, run, static_cast<size_t>(pos - run));
+                ++pos;
+                return;
+            }
+            auto str = std::string{run, pos};
+            while (pos != end && *pos != '"') {
+                auto c = *pos++;
+                if (static_cast<unsigned char>(c) < 0x20)
+                    fail("control character in string");
+                if (c != '\\') {
+                    str.push_back(c);
+                    continue;
+                }
+                if (pos == end)
+                    break;
+                switch (*pos++) {
+                case '"': str.push_back('"'); break;
+                case '\\': str.push_back('\\'); break;
+                case '/': str.push_back('/'); break;
+                case 'n': str.push_back('\n'); break;
+                case 'r': str.push_back('\r'); break;
+                case 't': str.push_back('\t'); break;
+                case 'b': str.push_back('\b'); break;
+                case 'f': str.push_back('\f'); break;
+                case 'u': {
+                    auto code = hex4();
+                    if (code >= 0xdc00 && code <= 0xdfff)
+                        fail("invalid surrogate");
+                    if (code >= 0xd800 && code <= 0xdbff) {
+                        if (end - pos < 2 || pos[0] != '\\' || pos[1] != 'u')
+                            fail("invalid surrogate");
+                        pos += 2;
+                        auto low = hex4();
+                        if (low < 0xdc00 || low > 0xdfff)
+                            fail("invalid surrogate");
+                        code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                    }
+                    put_utf8(str, code);
+                    break;
+                }
+                default:
+                    fail("invalid escape");
+                }
+            }
+            if (pos == end)
+                fail("unterminated string");
+            ++pos;
+            lua_pushlstring(L, str.data(), str.size());
+        }
+
+        // moves the collected elements above base (keys and values for objects) into the table,
+        // which is created and placed at base + 1 on the first call
+        // pop all above the table
+        void flush(int base, int &tidx, LuaInt &n, bool isobject) {
+            auto first = tidx ? tidx + 1 : base + 1;
+            auto count = lua_gettop(L) - first + 1;
+            if (!tidx) {
+                if (isobject)
+                    lua_createtable(L, 0, count / 2);
+                else
+                    lua_createtable(L, count, 0);
+                lua_insert(L, first);
+                tidx = first++;
+            }
+            for (auto i = first; i < first + count; ++i) {
+                lua_pushvalue(L, i);
+                if (isobject) {
+                    lua_pushvalue(L, ++i);
+                    lua_rawset(L, tidx);
+                } else {
+                    lua_rawseti(L, tidx, ++n);
+                }
+            }
+            lua_settop(L, tidx);
+        }
+
+        void decode_array(int depth) {
+            if (depth > max_nesting)
+                fail("nested too deep");
+            auto base = lua_gettop(L);
+            auto tidx = 0;
+            auto n = LuaInt{};
+            if (!consume(']')) {
+                do {
+                    decode(depth);
+                    if (lua_gettop(L) - (tidx ? tidx : base) == json_batch)
+                        flush(base, tidx, n, false);
+                } while (consume(','));
+                if (!consume(']'))
+                    fail("expected ',' or ']'");
+            }
+            flush(base, tidx, n, false);
+        }
+
+        void decode_object(int depth) {
+            if (depth > max_nesting)
+                fail("nested too deep");
+            auto base = lua_gettop(L);
+            auto tidx = 0;
+            auto n = LuaInt{};
+            if (!consume('}')) {
+                do {
+                    if (!consume('"'))
+                        fail("expected string key");
+                    decode_string();
+                    if (!consume(':'))
+                        fail("expected ':'");
+                    decode(depth);
+                    if (lua_gettop(L) - (tidx ? tidx : base) == 2 * json_batch)
+                        flush(base, tidx, n, true);
+                } while (consume(','));
+                if (!consume('}'))
+                    fail("expected ',' or '}'");
+            }
+            flush(base, tidx, n, true);
+        }
+
+        // the whole text must be one value
+        // pop 0, push 1
+        void decode_all() {
+            decode();
+            skip_space();
+            if (pos != end)
+                fail("trailing data");
+        }
+    };
+
+    // appends the value at idx to buf. on error buf is left unchanged
+    // pop 0, push 0
+    void encode_json(lua_State *L, int idx, std::string &buf, const char *name) {
+        auto top = lua_gettop(L);
+        auto size = buf.size();
+        try {
+            json_writer{L, buf, {}}.write(idx, name);
+        } catch (...) {
+            lua_settop(L, top);
+            buf.resize(size);
+            throw;
+        }
+    }
+
+    // pop 0, push 1
+    void decode_json(lua_State *L, const char *text, size_t len) {
+        auto top = lua_gettop(L);
+        try {
+            json_reader{L, text, text, text + len}.decode_all();
+        } catch (...) {
+            lua_settop(L, top);
+            throw;
+        }
+    }
+
+    int json_encode(lua_State *L) {
+        luaL_checkany(L, 1);
+        lua_settop(L, 1);
+        auto ok = stack::catch_to_message(L, [L] {
+            auto buf = std::string{};
+            encode_json(L, 1, buf, "argument");
+            lua_pushlstring(L, buf.data(), buf.size());
+        });
+        return ok ? 1 : lua_error(L);
+    }
+
+    int json_decode(lua_State *L) {
+        auto len = size_t{};
+        auto text = luaL_checklstring(L, 1, &len);
+        lua_settop(L, 1);
+        auto ok = stack::catch_to_message(L, [L, text, len] { decode_json(L, text, len); });
+        return ok ? 1 : lua_error(L);
+    }
+
+    int open_json_module(lua_State *L) {
+        static const luaL_Reg functions[] = {
+            {"encode", json_encode},
+            {"decode", json_decode},
+            {NULL, NULL}
+        };
+        luaL_newlib(L, functions);
+        lua_pushlightuserdata(L, NULL);
+        lua_setfield(L, -2, "null");
+        return 1;
+    }
+
+    // copies values from one state to another. tables reached twice are copied once, so shared
+    // references and cycles are kept. the copies are remembered by id in the table at memo
+    struct value_copier {
+        lua_State *from;
+        lua_State *to;
+        int memo;
+        std::unordered_map<const void *, LuaInt> ids;
+
+        // pop 0 from, push 1 to
+        void copy(int idx, const char *name, int depth = 0) {
+            if (!lua_checkstack(to, 3))
+                throw luastate_error{"cannot grow Lua stack: out of memory"};
+            switch (lua_type(from, idx)) {
+            case LUA_TNIL:
+                return lua_pushnil(to);
+            case LUA_TBOOLEAN:
+                return lua_pushboolean(to, lua_toboolean(from, idx));
+            case LUA_TNUMBER:
+                if (lua_isinteger(from, idx))
+                    return lua_pushinteger(to, lua_tointeger(from, idx));
+                return lua_pushnumber(to, lua_tonumber(from, idx));
+            case LUA_TSTRING: {
+                auto len = size_t{};
+                auto str = lua_tolstring(from, idx, &len);
+                lua_pushlstring(to, str, len);
+                return;
+            }
+            case LUA_TLIGHTUSERDATA:
+                return lua_pushlightuserdata(to, lua_touserdata(from, idx));
+            case LUA_TTABLE:
+                return copy_table(idx, name, depth + 1);
+            case LUA_TUSERDATA:
+                if (auto ud = test_shared(from, idx))
+                    return stack::push_shared(to, ud->table);
+                break;
+            }
+            throw luastate_error{std::string{"variable/field ["} + name + "] cannot be copied: unsupported type "
+                + luaL_typename(from, idx)};
+        }
+
+        void copy_table(int idx, const char *name, int depth) {
+            auto ptr = lua_topointer(from, idx);
+            auto found = ids.find(ptr);
+            if (found != ids.end()) {
+                lua_rawgeti(to, memo, found->second);
+                return;
+            }
+            if (depth > max_nesting)
+                throw luastate_error{std::string{"variable/field ["} + name + "] cannot be copied: nested too deep"};
+            if (!lua_checkstack(from, 3))
+                throw luastate_error{"cannot grow Lua stack: out of memory"};
+            auto len = lua_rawlen(from, idx);
+            auto count = size_t{};
+            lua_pushnil(from);
+            while (lua_next(from, idx)) {
+                ++count;
+                lua_pop(from, 1);
+            }
+            lua_createtable(to, static_cast<int>(len), static_cast<int>(count > len ? count - len : 0));
+            auto tidx = lua_gettop(to);
+            // remembered before the fields are copied, so cycles come back to it
+            auto id = static_cast<LuaInt>(ids.size() + 1);
+            ids.emplace(ptr, id);
+            lua_pushvalue(to, tidx);
+            lua_rawseti(to, memo, id);
+            lua_pushnil(from);
+            while (lua_next(from, idx)) {
+                auto top = lua_gettop(from);
+                copy(top - 1, name, depth);
+                copy(top, lua_type(from, top - 1) == LUA_TSTRING ? lua_tostring(from, top - 1) : name, depth);
+                lua_rawset(to, tidx);
+                lua_pop(from, 1);
+            }
+        }
+    };
+
+    // the members of a bound class, in a userdata referenced by its metatable
+    // member names are interned lua strings, anchored by the members table, so a key is a member iff it
+    // is the same string object. they are looked up with a perfect hash of their addresses, rebuilt
+    // whenever a member is added: one multiply, one shift and one compare per lookup
+    // a member is a property index if positive, a method index (into the members table) if negative
+    struct class_info {
+        struct property {
+            stack::property_get get;
+            stack::property_set set;
+            alignas(std::max_align_t) unsigned char member[2 * sizeof(void *)];
+        };
+        struct slot {
+            const char *name;
+            int member;
+        };
+
+        std::vector<property> properties;
+        int methods = 0;
+        std::vector<slot> members;
+        std::vector<slot> slots = std::vector<slot>(2);
+        std::uint64_t multiplier = 1;
+        int shift = 63;
+        // names too long to be interned are only found in the members table
+        bool long_names = false;
+
+        size_t slot_of(const char *name, std::uint64_t mult, int bits) const noexcept {
+            return static_cast<size_t>((static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(name)) * mult) >> bits);
+        }
+
+        // 0 if the string at idx is not a member
+        int find(lua_State *L, int idx, int membersidx) const {
+            if (lua_type(L, idx) != LUA_TSTRING)
+                return 0;
+            auto name = lua_tostring(L, idx);
+            const auto &found = slots[slot_of(name, multiplier, shift)];
+            if (found.name == name)
+                return found.member;
+            if (!long_names)
+                return 0;
+            lua_pushvalue(L, idx);
+            lua_rawget(L, membersidx);
+            auto member = static_cast<int>(lua_tointeger(L, -1));
+            lua_pop(L, 1);
+            return member;
+        }
+
+        void add(const char *name, int member) {
+            auto same = std::find_if(members.begin(), members.end(), [name](const slot &m) { return m.name == name; });
+            if (same != members.end())
+                same->member = member;
+            else
+                members.push_back({name, member});
+            rebuild();
+        }
+
+        // tries multipliers from a fixed sequence, doubling the table when they all collide
+        void rebuild() {
+            for (auto bits = 1; ; ++bits) {
+                auto size = size_t{1} << bits;
+                if (size < 2 * members.size())
+                    continue;
+                auto seed = std::uint64_t{0x9e3779b97f4a7c15};
+                for (auto attempt = 0; attempt < 64; ++attempt) {
+                    auto mult = (seed ^ (seed >> 29)) * 0xbf58476d1ce4e5b9 | 1;
+                    seed += 0x9e3779b97f4a7c15;
+                    auto table = std::vector<slot>(size);
+                    auto ok = true;
+                    for (const auto &m : members) {
+                        auto &place = table[slot_of(m.name, mult, 64 - bits)];
+                        ok = ok && !place.name;
+                        place = m;
+                    }
+                    if (ok) {
+                        slots = std::move(table);
+                        multiplier = mult;
+                        shift = 64 - bits;
+                        return;
+                    }
+                }
+            }
+        }
+    };
+
+    const char class_info_key = 0;
+    const char class_members_key = 0;
+    const char class_info_meta_key = 0;
+
+    int class_info_gc(lua_State *L) {
+        static_cast<class_info *>(lua_touserdata(L, 1))->~class_info();
+        return 0;
+    }
+
+    // pop 0, push 1
+    void push_class(lua_State *L, const void *key) {
+        if (!lua_checkstack(L, 6))
+            throw luastate_error{"cannot grow Lua stack: out of memory"};
+        if (lua_rawgetp(L, LUA_REGISTRYINDEX, key) != LUA_TTABLE) {
+            lua_pop(L, 1);
+            throw luastate_error{"class is not registered"};
+        }
+    }
+
+    // adds the member called name (on the top) to the class on the top - 1
+    // pop 1, push 0
+    void add_member(lua_State *L, int member) {
+        lua_rawgetp(L, -2, &class_info_key);
+        auto info = static_cast<class_info *>(lua_touserdata(L, -1));
+        lua_rawgetp(L, -3, &class_members_key);
+        lua_pushvalue(L, -3);
+        lua_pushinteger(L, member);
+        lua_rawset(L, -3);
+        // the same content pushed again is the same object only if it is interned
+        auto name = lua_tostring(L, -3);
+        lua_pushstring(L, name);
+        auto interned = lua_tostring(L, -1) == name;
+        lua_pop(L, 4);
+        if (interned)
+            info->add(name, member);
+        else
+            info->long_names = true;
+    }
+
+    void check_object(lua_State *L) {
+        if (!lua_getmetatable(L, 1) || !lua_rawequal(L, -1, lua_upvalueindex(1)))
+            luaL_argerror(L, 1, "bound object expected");
+        lua_pop(L, 1);
+    }
+
+    // upvalues: metatable, members table, class_info
+    int object_index(lua_State *L) {
+        check_object(L);
+        auto info = static_cast<class_info *>(lua_touserdata(L, lua_upvalueindex(3)));
+        auto member = info->find(L, 2, lua_upvalueindex(2));
+        if (member < 0) {
+            lua_rawgeti(L, lua_upvalueindex(2), -member);
+            return 1;
+        }
+        if (member == 0) {
+            lua_pushnil(L);
+            return 1;
+        }
+        auto &prop = info->properties[static_cast<size_t>(member - 1)];
+        return prop.get(L, lua_touserdata(L, 1), prop.member) ? 1 : lua_error(L);
+    }
+
+    int object_newindex(lua_State *L) {
+        check_object(L);
+        auto info = static_cast<class_info *>(lua_touserdata(L, lua_upvalueindex(3)));
+        auto member = info->find(L, 2, lua_upvalueindex(2));
+        if (member <= 0)
+            return luaL_error(L, "cannot assign field '%s' of a bound object", luaL_tolstring(L, 2, NULL));
+        auto &prop = info->properties[static_cast<size_t>(member - 1)];
+        if (!prop.set)
+            return luaL_error(L, "property '%s' is read-only", lua_tostring(L, 2));
+        return prop.set(L, lua_touserdata(L, 1), prop.member, 3) ? 0 : lua_error(L);
+    }
+
+    // runs the rows of a batch from b->next on: the function is at 1, the batch at 2
+    // no C++ object is in scope, so an error of a row can jump out of here
+    int run_batch(lua_State *L) {
+        auto b = static_cast<stack::batch *>(lua_touserdata(L, 2));
+        luaL_checkstack(L, b->nargs + 1, "too many arguments");
+        for (; b->next < b->rows; ++b->next) {
+            lua_pushvalue(L, 1);
+            b->push_row(b->context, L, b->next);
+            lua_call(L, b->nargs, 1);
+            b->store_row(b->context, L, b->next, 3);
+            lua_settop(L, 2);
+        }
+        return 0;
+    }
+
+    // a stack frame of an error, copied out of its lua_Debug: the strings of the frame may be
+    // collected once the error unwinds. namewhat and what are static strings of lua
+    struct trace_frame {
+        char source[LUA_IDSIZE];
+        char name[48];
+        const char *namewhat;
+        const char *what;
+        int currentline;
+        int linedefined;
+        bool tailcall;
+    };
+
+    // the frames of the last error, filled by the message handler without allocating
+    struct error_trace {
+        std::vector<trace_frame> frames; // sized to the maximum depth
+        std::size_t count = 0;
+        bool truncated = false;
+    };
+
+    // copies the frames of L from level on into trace
+    void record_trace(lua_State *L, int level, error_trace &trace) noexcept {
+        lua_Debug ar;
+        trace.count = 0;
+        for (; trace.count < trace.frames.size() && lua_getstack(L, level, &ar); ++level) {
+            lua_getinfo(L, "Slnt", &ar);
+            auto &frame = trace.frames[trace.count++];
+            std::memcpy(frame.source, ar.short_src, sizeof frame.source);
+            std::snprintf(frame.name, sizeof frame.name, "%s", ar.name ? ar.name : "?");
+            frame.namewhat = ar.namewhat;
+            frame.what = ar.what;
+            frame.currentline = ar.currentline;
+            frame.linedefined = ar.linedefined;
+            frame.tailcall = ar.istailcall;
+        }
+        trace.truncated = lua_getstack(L, level, &ar);
+    }
+
+    // the registry key of the error trace of the interpreter, as a light userdata. states not made by
+    // lua_interpreter have none, so their protected calls run without a message handler
+    const char error_trace_key = 0;
+
+    // the trace of the interpreter owning L, or NULL. needs 1 free stack slot
+    error_trace *trace_of(lua_State *L) noexcept {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, &error_trace_key);
+        auto trace = static_cast<error_trace *>(lua_touserdata(L, -1));
+        lua_pop(L, 1);
+        return trace;
+    }
+
+    // message handler of protected calls: records the frames above it and returns the error
+    // message unchanged. the traceback string is only built by lua_interpreter::traceback()
+    int capture_trace(lua_State *L) {
+        // level 0 is the handler
+        record_trace(L, 1, *trace_of(L));
+        return 1;
+    }
 
-namespace {
-    constexpr int IGNORED {};
+    // a lua thread kept for reuse by coroutines, anchored in the registry by ref
+    struct pooled_thread {
+        lua_State *co;
+        int ref;
+    };
+
+    // same lines as luaL_traceback(), except that functions are not searched in loaded modules
+    void format_trace(const error_trace &trace, std::string &out) {
+        out += "stack traceback:";
+        char line[32];
+        for (std::size_t i = 0; i < trace.count; ++i) {
+            auto &frame = trace.frames[i];
+            out += "\n\t";
+            out += frame.source;
+            out += ':';
+            if (frame.currentline > 0) {
+                std::snprintf(line, sizeof line, "%d:", frame.currentline);
+                out += line;
+            }
+            out += " in ";
+            if (*frame.namewhat) {
+                out += frame.namewhat;
+                out += " '";
+                out += frame.name;
+                out += '\'';
+            } else if (*frame.what == 'm') {
+                out += "main chunk";
+            } else if (*frame.what != 'C') {
+                std::snprintf(line, sizeof line, ":%d>", frame.linedefined);
+                out += "function <";
+                out += frame.source;
+                out += line;
+            } else {
+                out += '?';
+            }
+            if (frame.tailcall)
+                out += "\n\t(...tail calls...)";
+        }
+        if (trace.truncated)
+            out += "\n\t...";
+    }
+
+    // clears the trace of the last error and, if tracebacks are on, pushes the message handler below
+    // the function and its nargs arguments. returns the index of the handler, or 0
+    // needs 1 free stack slot
+    int push_message_handler(lua_State *L, int nargs) {
+        auto trace = trace_of(L);
+        if (!trace)
+            return 0;
+        trace->count = 0;
+        if (trace->frames.empty())
+            return 0;
+        lua_pushcfunction(L, capture_trace);
+        auto msgh = lua_gettop(L) - nargs - 1;
+        lua_insert(L, msgh);
+        return msgh;
+    }
 
     // used to build ugly error message
     auto operator+(const std::string &lhs, keytype_t<var_where::TABLE_INDEX> num) {
@@ -34,16 +1875,24 @@ namespace {
     auto operator+(const std::string &lhs, keytype_t<var_where::FUNC1>) {
         return lhs + "function()";
     }
+    auto operator+(const std::string &lhs, keytype_t<var_where::TABLE_KEY> key) {
+        return lhs + key.name();
+    }
 }
 
 struct lua_interpreter::impl {
     lua_State *L;
+    error_trace trace;
+    // threads of finished coroutines, the last one is reused first
+    std::vector<pooled_thread> threads;
 
     impl() {
         auto state = luaL_newstate();
         if (state == NULL)
             throw luastate_error{"cannot create lua state: out of memory"};
         L = state;
+        lua_pushlightuserdata(L, &trace);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &error_trace_key);
     }
 
     impl(impl &&) = delete;
@@ -55,7 +1904,16 @@ struct lua_interpreter::impl {
 
     // pop 0, push 0
     std::tuple<bool, std::string> run_chunk(const char *code) noexcept {
-        auto error = luaL_loadstring(L, code) || lua_pcall(L, 0, 0, 0);
+        trace.count = 0;
+        if (!lua_checkstack(L, 2))
+            return { false, "cannot grow Lua stack: out of memory" };
+        auto error = luaL_loadstring(L, code);
+        if (!error) {
+            auto msgh = push_message_handler(L, 0);
+            error = lua_pcall(L, 0, 0, msgh);
+            if (msgh)
+                lua_remove(L, msgh);
+        }
         if (error) {
             auto errmsg = lua_tostring(L, -1);
             lua_pop(L, 1); // remove err msg
@@ -68,15 +1926,28 @@ struct lua_interpreter::impl {
     template<var_where VarWhere>
     void get_by_key(keytype_t<VarWhere> key, int tidx);
 
+    // the value on the top has a wrong type: throws, or only reports the reason if err is given
+    // pop 1, push 0
+    template<class KeyT>
+    void mismatch(const KeyT &key, const char *throwmsg, get_error *err) {
+        auto isnil = lua_isnil(L, -1);
+        lua_pop(L, 1);
+        if (!err)
+            throw luastate_error{std::string{"variable/field ["} + key + "] is not " + throwmsg};
+        *err = isnil ? get_error::NIL : get_error::WRONG_TYPE;
+    }
+
     // grab value found by "key" based on the table at index "tidx"
     // if VarWhere is GLOBAL then tidx should be ignored
+    // if err is given, errors are stored there instead of thrown and R{} is returned
     // pop 0, push 0
     template<var_where VarWhere, class R, class Cvrt, class Check, class KeyT = keytype_t<VarWhere>>
-    R get_what_impl(KeyT key, int tidx, Cvrt &&cvrtfunc, Check &&checkfunc, const char *throwmsg) {
+    R get_what_impl(const KeyT &key, int tidx, Cvrt &&cvrtfunc, Check &&checkfunc, const char *throwmsg,
+            get_error *err = nullptr) {
         get_by_key<VarWhere>(key, tidx);
         if (!checkfunc(L, -1)) {
-            lua_pop(L, 1);
-            throw luastate_error{std::string{"variable/field ["} + key + "] is not " + throwmsg};
+            mismatch(key, throwmsg, err);
+            return R{};
         }
         auto result = cvrtfunc(L, -1, NULL);
         lua_pop(L, 1);
@@ -86,42 +1957,48 @@ struct lua_interpreter::impl {
     // PARTIAL SPECIALIZATIONS
     // calls get_what_impl(), pop 0, push 0
     template<var_where VarWhere, types Type, class R = get_var_t<Type>, class KeyT = keytype_t<VarWhere>>
-    std::enable_if_t<Type == types::INT, R> get_what(KeyT key, int tidx) {
+    std::enable_if_t<Type == types::INT, R> get_what(const KeyT &key, int tidx, get_error *err = nullptr) {
         return get_what_impl<VarWhere, R>(key, tidx, lua_tointegerx, lua_isinteger,
-            "integer");
+            "integer", err);
     }
 
     // PARTIAL SPECIALIZATIONS
     // calls get_what_impl(), pop 0, push 0
     template<var_where VarWhere, types Type, class R = get_var_t<Type>, class KeyT = keytype_t<VarWhere>>
-    std::enable_if_t<Type == types::NUM, R> get_what(KeyT key, int tidx) {
+    std::enable_if_t<Type == types::NUM, R> get_what(const KeyT &key, int tidx, get_error *err = nullptr) {
         return get_what_impl<VarWhere, R>(key, tidx, lua_tonumberx, lua_isnumber,
-            "number or string convertible to number");
+            "number or string convertible to number", err);
     }
 
     // PARTIAL SPECIALIZATIONS
     // calls get_what_impl(), pop 0, push 0
     template<var_where VarWhere, types Type, class R = get_var_t<Type>, class KeyT = keytype_t<VarWhere>>
-    std::enable_if_t<Type == types::STR, R> get_what(KeyT key, int tidx) {
-        return get_what_impl<VarWhere, R>(key, tidx, lua_tolstring, lua_isstring,
-            "string or number");
+    std::enable_if_t<Type == types::STR, R> get_what(const KeyT &key, int tidx, get_error *err = nullptr) {
+        // keep the length so embedded zeros survive and no strlen() is needed
+        static auto tostring = [](auto ls, auto idx, auto) {
+            auto len = size_t{};
+            auto s = lua_tolstring(ls, idx, &len);
+            return R{s, len};
+        };
+        return get_what_impl<VarWhere, R>(key, tidx, tostring, lua_isstring,
+            "string or number", err);
     }
 
     // PARTIAL SPECIALIZATIONS
     // calls get_what_impl(), pop 0, push 0
     template<var_where VarWhere, types Type, class R = get_var_t<Type>, class KeyT = keytype_t<VarWhere>>
-    std::enable_if_t<Type == types::BOOL, R> get_what(KeyT key, int tidx) {
+    std::enable_if_t<Type == types::BOOL, R> get_what(const KeyT &key, int tidx, get_error *err = nullptr) {
         static auto toboolean = [](auto ls, auto idx, auto) { return static_cast<R>(lua_toboolean(ls, idx)); };
         // because lua_isboolean is macro
         static auto isboolean = [](auto ls, auto idx) { return lua_isboolean(ls, idx); };
         return get_what_impl<VarWhere, R>(key, tidx, toboolean, isboolean,
-            "boolean");
+            "boolean", err);
     }
 
     // like get_what_impl(), but returns a type enum
     // pop 0, push 0
     template<var_where VarWhere, class KeyT = keytype_t<VarWhere>>
-    auto get_type_impl(KeyT key, int tidx) {
+    auto get_type_impl(const KeyT &key, int tidx) {
         get_by_key<VarWhere>(key, tidx);
         auto typeint = lua_type(L, -1);
         auto res = 
@@ -140,18 +2017,70 @@ struct lua_interpreter::impl {
     // PARTIAL SPECIALIZATIONS
     // calls get_type_impl(), pop 0, push 0
     template<var_where VarWhere, types Type, class R = get_var_t<Type>, class KeyT = keytype_t<VarWhere>>
-    std::enable_if_t<Type == types::LTYPE, R> get_what(KeyT key, int tidx) {
+    std::enable_if_t<Type == types::LTYPE, R> get_what(const KeyT &key, int tidx, get_error * = nullptr) {
         return get_type_impl<VarWhere>(key, tidx);
     }
 
+    // pop 1, push 0
+    template<var_where VarWhere>
+    void set_by_key(keytype_t<VarWhere> key, int tidx);
+
     // pop 0, push 1
+    void push_value(LuaInt value) noexcept { lua_pushinteger(L, value); }
+    void push_value(double value) noexcept { lua_pushnumber(L, value); }
+    void push_value(const std::string &value) { lua_pushlstring(L, value.data(), value.size()); }
+    void push_value(bool value) noexcept { lua_pushboolean(L, value); }
+    void push_value(std::nullptr_t) noexcept { lua_pushnil(L); }
+
+    // assign value to "key" based on the table at index "tidx"
+    // if VarWhere is GLOBAL then tidx should be ignored
+    // pop 0, push 0
+    template<var_where VarWhere, types Type, class KeyT = keytype_t<VarWhere>>
+    void set_what(const KeyT &key, int tidx, set_var_t<Type> value) {
+        if (VarWhere != var_where::GLOBAL)
+            protect_indexing(tidx);
+        push_value(value);
+        set_by_key<VarWhere>(key, tidx);
+    }
+
+    // assign the table at index "srcidx" to "key" based on the table at index "tidx"
+    // pop 0, push 0
     template<var_where VarWhere, class KeyT = keytype_t<VarWhere>>
-    void push_table(KeyT key, int tidx) {
+    void set_table(const KeyT &key, int tidx, const impl *srcstate, int srcidx) {
+        if (srcstate != this)
+            throw luastate_error{"table handle belongs to another lua state"};
+        protect_indexing(srcidx);
+        if (VarWhere != var_where::GLOBAL)
+            protect_indexing(tidx);
+        lua_pushvalue(L, srcidx);
+        set_by_key<VarWhere>(key, tidx);
+    }
+
+    // pop 0, push 1 (push 0 if err is set)
+    template<var_where VarWhere, class KeyT = keytype_t<VarWhere>>
+    void push_table(const KeyT &key, int tidx, get_error *err = nullptr) {
         get_by_key<VarWhere>(key, tidx);
-        if (!lua_istable(L, -1)) {
-            lua_pop(L, 1);
-            throw luastate_error{std::string{"variable/field ["} + key + "] is not table"};
+        if (!lua_istable(L, -1))
+            mismatch(key, "table", err);
+    }
+
+    // leaves the string on the stack, the returned pointer is valid as long as it stays there
+    // pop 0, push 1 (push 0 if err is set)
+    template<var_where VarWhere, class KeyT = keytype_t<VarWhere>>
+    const char *push_string(const KeyT &key, int tidx, size_t &len, get_error *err = nullptr) {
+        get_by_key<VarWhere>(key, tidx);
+        if (!lua_isstring(L, -1)) {
+            mismatch(key, "string or number", err);
+            return nullptr;
         }
+        return lua_tolstring(L, -1, &len);
+    }
+
+    // the name is referenced from the registry so it stays interned
+    // pop 0, push 0
+    int make_key(const char *name) {
+        lua_pushstring(L, name);
+        return luaL_ref(L, LUA_REGISTRYINDEX);
     }
 
     // pop 0, push 0
@@ -159,55 +2088,672 @@ struct lua_interpreter::impl {
         return lua_gettop(L);
     }
 
-    // rotate, 1 removed overall
-    void remove_table(int idx) noexcept {
-        lua_remove(L, idx);
+    // rotate, 1 removed overall
+    void remove_table(int idx) noexcept {
+        lua_remove(L, idx);
+    }
+
+    // assumes table is already in the stack at index tidx
+    // pop 0, push 0
+    auto table_len(int tidx) {
+        return get_what_impl<var_where::FUNC1, LuaInt>(lua_len, tidx, lua_tointegerx, lua_isinteger,
+            "integer");
+    }
+
+    bool valid_indexing(int idx) noexcept {
+        return get_top_idx() >= idx;
+    }
+
+    void protect_indexing(int idx) {
+        if (!valid_indexing(idx))
+            throw luastate_error{"Malformed Lua stack indexing"};
+    }
+
+    void reserve_stack(int n) {
+        if (!lua_checkstack(L, n))
+            throw luastate_error{"cannot grow Lua stack: out of memory"};
+    }
+
+    // pushes fields of the table at index tidx, last key first
+    // pop 0, push n
+    void push_fields(const char *const *keys, int n, int tidx) {
+        protect_indexing(tidx);
+        reserve_stack(n);
+        for (auto i = n - 1; i >= 0; --i)
+            lua_getfield(L, tidx, keys[i]);
+    }
+
+    // pop all, push 0
+    void restore_top(int top) noexcept {
+        lua_settop(L, top);
+    }
+
+    ~impl() {
+        if (L)
+            lua_close(L);
+    }
+};
+
+// int param is ignored
+template<>
+void lua_interpreter::impl::get_by_key<var_where::GLOBAL>(keytype_t<var_where::GLOBAL> keyname, int) {
+    lua_getglobal(L, keyname);
+}
+
+// assumes table is already on the stack at index tidx
+template<>
+void lua_interpreter::impl::get_by_key<var_where::TABLE>(keytype_t<var_where::TABLE> keyname, int tidx) {
+    protect_indexing(tidx);
+    lua_getfield(L, tidx, keyname);
+}
+
+// assumes table is already on the stack at index tidx
+template<>
+void lua_interpreter::impl::get_by_key<var_where::TABLE_INDEX>(keytype_t<var_where::TABLE_INDEX> keyidx, int tidx) {
+    protect_indexing(tidx);
+    lua_geti(L, tidx, keyidx);
+}
+
+// assumes table is already on the stack at index tidx
+// pushes the registered string instead of hashing the name again
+template<>
+void lua_interpreter::impl::get_by_key<var_where::TABLE_KEY>(keytype_t<var_where::TABLE_KEY> key, int tidx) {
+    protect_indexing(tidx);
+    if (key.owner() != this)
+        throw luastate_error{"key [" + key.name() + "] is registered by another lua state"};
+    lua_rawgeti(L, LUA_REGISTRYINDEX, key.ref());
+    lua_gettable(L, tidx);
+}
+
+// value to assign is on the top, int param is ignored
+template<>
+void lua_interpreter::impl::set_by_key<var_where::GLOBAL>(keytype_t<var_where::GLOBAL> keyname, int) {
+    lua_setglobal(L, keyname);
+}
+
+// assumes table is already on the stack at index tidx, value to assign is on the top
+template<>
+void lua_interpreter::impl::set_by_key<var_where::TABLE>(keytype_t<var_where::TABLE> keyname, int tidx) {
+    lua_setfield(L, tidx, keyname);
+}
+
+// assumes table is already on the stack at index tidx, value to assign is on the top
+template<>
+void lua_interpreter::impl::set_by_key<var_where::TABLE_INDEX>(keytype_t<var_where::TABLE_INDEX> keyidx, int tidx) {
+    lua_seti(L, tidx, keyidx);
+}
+
+// assumes table is already on the stack at index tidx, value to assign is on the top
+template<>
+void lua_interpreter::impl::set_by_key<var_where::TABLE_KEY>(keytype_t<var_where::TABLE_KEY> key, int tidx) {
+    if (key.owner() != this) {
+        lua_pop(L, 1);
+        throw luastate_error{"key [" + key.name() + "] is registered by another lua state"};
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, key.ref());
+    lua_insert(L, -2);
+    lua_settable(L, tidx);
+}
+
+// value is already pushed by the caller
+template<>
+void lua_interpreter::impl::get_by_key<var_where::PUSHED>(keytype_t<var_where::PUSHED>, int) {}
+
+// key is a function
+// calls function
+template<>
+void lua_interpreter::impl::get_by_key<var_where::FUNC1>(keytype_t<var_where::FUNC1> f, int tidx) {
+    protect_indexing(tidx);
+    f(L, tidx);
+}
+
+int stack::get_top(lua_State *L) noexcept {
+    return lua_gettop(L);
+}
+
+void stack::set_top(lua_State *L, int top) noexcept {
+    lua_settop(L, top);
+}
+
+void stack::reserve(lua_State *L, int n) {
+    if (!lua_checkstack(L, n))
+        throw luastate_error{"cannot grow Lua stack: out of memory"};
+}
+
+void stack::push_nil(lua_State *L) {
+    lua_pushnil(L);
+}
+
+void stack::push_integer(lua_State *L, LuaInt value) {
+    lua_pushinteger(L, value);
+}
+
+void stack::push_number(lua_State *L, double value) {
+    lua_pushnumber(L, value);
+}
+
+void stack::push_boolean(lua_State *L, bool value) {
+    lua_pushboolean(L, value);
+}
+
+void stack::push_string(lua_State *L, const char *str, size_t len) {
+    lua_pushlstring(L, str, len);
+}
+
+void stack::push_string(lua_State *L, const char *str) {
+    lua_pushstring(L, str);
+}
+
+void stack::push_copy(lua_State *L, int idx) {
+    lua_pushvalue(L, idx);
+}
+
+void stack::new_table(lua_State *L, int narr, int nrec) {
+    lua_createtable(L, narr, nrec);
+}
+
+void stack::get_global(lua_State *L, const char *name) {
+    lua_getglobal(L, name);
+}
+
+void stack::get_field(lua_State *L, int tidx, const char *key) {
+    lua_getfield(L, tidx, key);
+}
+
+void stack::get_index(lua_State *L, int tidx, LuaInt n) {
+    lua_geti(L, tidx, n);
+}
+
+void stack::raw_get_index(lua_State *L, int tidx, LuaInt n) {
+    lua_rawgeti(L, tidx, n);
+}
+
+void stack::raw_get(lua_State *L, int tidx) {
+    lua_rawget(L, tidx);
+}
+
+void stack::raw_get_field(lua_State *L, int tidx, const char *key) {
+    tidx = lua_absindex(L, tidx);
+    lua_pushstring(L, key);
+    lua_rawget(L, tidx);
+}
+
+void stack::call(lua_State *L, int nargs, int nresults) {
+    if (!lua_checkstack(L, 1))
+        throw luastate_error{"cannot grow Lua stack: out of memory"};
+    auto msgh = push_message_handler(L, nargs);
+    auto status = lua_pcall(L, nargs, nresults, msgh);
+    if (msgh)
+        lua_remove(L, msgh);
+    if (status != LUA_OK) {
+        auto msg = lua_tostring(L, -1);
+        auto error = luastate_error{msg ? msg : "(error object is not a string)"};
+        lua_pop(L, 1);
+        throw error;
+    }
+}
+
+void stack::push_closure(lua_State *L, c_function f, const void *data, size_t size) {
+    if (!lua_checkstack(L, 2))
+        throw luastate_error{"cannot grow Lua stack: out of memory"};
+    std::memcpy(lua_newuserdata(L, size), data, size);
+    lua_pushcclosure(L, f, 1);
+}
+
+void *stack::closure_data(lua_State *L) noexcept {
+    return lua_touserdata(L, lua_upvalueindex(1));
+}
+
+int stack::raise_error(lua_State *L) {
+    return lua_error(L);
+}
+
+const char *stack::arg_name(int n) noexcept {
+    static const char *const names[] = {
+        "argument #1", "argument #2", "argument #3", "argument #4",
+        "argument #5", "argument #6", "argument #7", "argument #8"
+    };
+    return n >= 1 && n <= 8 ? names[n - 1] : "argument";
+}
+
+static_assert(std::is_same<stack::k_context, lua_KContext>::value, "k_context must be lua_KContext");
+
+int stack::yield(lua_State *L, int nresults, k_context ctx, k_function k) {
+    return lua_yieldk(L, nresults, ctx, k);
+}
+
+bool stack::is_yieldable(lua_State *L) noexcept {
+    return lua_isyieldable(L);
+}
+
+void stack::push_light(lua_State *L, const void *p) {
+    lua_pushlightuserdata(L, const_cast<void *>(p));
+}
+
+void *stack::to_light(lua_State *L, int idx) noexcept {
+    return lua_islightuserdata(L, idx) ? lua_touserdata(L, idx) : nullptr;
+}
+
+void stack::call_batch(lua_State *L, batch &b) {
+    // errors of rows are reported in b.errors, without a traceback
+    if (!lua_checkstack(L, 3))
+        throw luastate_error{"cannot grow Lua stack: out of memory"};
+    if (auto trace = trace_of(L))
+        trace->count = 0;
+    auto fidx = lua_gettop(L);
+    while (b.next < b.rows) {
+        lua_pushcfunction(L, run_batch);
+        lua_pushvalue(L, fidx);
+        lua_pushlightuserdata(L, &b);
+        if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+            auto msg = lua_tostring(L, -1);
+            b.errors->push_back({b.next++, msg ? msg : "(error object is not a string)"});
+            lua_pop(L, 1);
+        }
+    }
+}
+
+void stack::new_class(lua_State *L, const void *key, const char *name, c_function gc) {
+    if (!lua_checkstack(L, 8))
+        throw luastate_error{"cannot grow Lua stack: out of memory"};
+    lua_createtable(L, 0, 4);
+    auto mt = lua_gettop(L);
+    lua_pushstring(L, name);
+    lua_setfield(L, mt, "__name");
+    lua_pushcfunction(L, gc);
+    lua_setfield(L, mt, "__gc");
+    lua_newtable(L);
+    new (lua_newuserdata(L, sizeof(class_info))) class_info{};
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &class_info_meta_key) == LUA_TNIL) {
+        lua_pop(L, 1);
+        lua_createtable(L, 0, 1);
+        lua_pushcfunction(L, class_info_gc);
+        lua_setfield(L, -2, "__gc");
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &class_info_meta_key);
+    }
+    lua_setmetatable(L, -2);
+    for (auto f : {object_index, object_newindex}) {
+        lua_pushvalue(L, mt);
+        lua_pushvalue(L, mt + 1);
+        lua_pushvalue(L, mt + 2);
+        lua_pushcclosure(L, f, 3);
+        lua_setfield(L, mt, f == object_index ? "__index" : "__newindex");
+    }
+    lua_rawsetp(L, mt, &class_info_key);
+    lua_rawsetp(L, mt, &class_members_key);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, key);
+}
+
+bool stack::has_class(lua_State *L, const void *key) {
+    if (!lua_checkstack(L, 1))
+        throw luastate_error{"cannot grow Lua stack: out of memory"};
+    auto found = lua_rawgetp(L, LUA_REGISTRYINDEX, key) == LUA_TTABLE;
+    lua_pop(L, 1);
+    return found;
+}
+
+void stack::add_method(lua_State *L, const void *key, const char *name, c_function f, const void *data, size_t size) {
+    push_class(L, key);
+    lua_rawgetp(L, -1, &class_info_key);
+    auto info = static_cast<class_info *>(lua_touserdata(L, -1));
+    lua_rawgetp(L, -2, &class_members_key);
+    std::memcpy(lua_newuserdata(L, size), data, size);
+    lua_pushvalue(L, -4);
+    lua_pushcclosure(L, f, 2);
+    lua_rawseti(L, -2, ++info->methods);
+    lua_pop(L, 2);
+    lua_pushstring(L, name);
+    try {
+        add_member(L, -info->methods);
+    } catch (...) {
+        lua_pop(L, 1);
+        throw;
+    }
+    lua_pop(L, 1);
+}
+
+void stack::add_property(lua_State *L, const void *key, const char *name, property_get get, property_set set,
+        const void *member, size_t size) {
+    auto prop = class_info::property{get, set, {}};
+    if (size > sizeof prop.member)
+        throw luastate_error{std::string{"property ["} + name + "] cannot be bound: member pointer too large"};
+    std::memcpy(prop.member, member, size);
+    push_class(L, key);
+    lua_rawgetp(L, -1, &class_info_key);
+    auto info = static_cast<class_info *>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    try {
+        info->properties.push_back(prop);
+        lua_pushstring(L, name);
+        add_member(L, static_cast<int>(info->properties.size()));
+    } catch (...) {
+        lua_pop(L, 1);
+        throw;
+    }
+    lua_pop(L, 1);
+}
+
+void stack::add_constructor(lua_State *L, const void *key, c_function f) {
+    push_class(L, key);
+    lua_getfield(L, -1, "__name");
+    auto name = lua_tostring(L, -1);
+    if (lua_getglobal(L, name) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setglobal(L, name);
+    }
+    lua_pushvalue(L, -3);
+    lua_pushcclosure(L, f, 1);
+    lua_setfield(L, -2, "new");
+    lua_pop(L, 3);
+}
+
+void *stack::new_object(lua_State *L, const void *key, size_t size) {
+    push_class(L, key);
+    return lua_newuserdata(L, size);
+}
+
+void *stack::construct_object(lua_State *L, size_t size) {
+    if (!lua_checkstack(L, 3))
+        throw luastate_error{"cannot grow Lua stack: out of memory"};
+    lua_pushvalue(L, lua_upvalueindex(1));
+    return lua_newuserdata(L, size);
+}
+
+void stack::finish_object(lua_State *L) {
+    lua_insert(L, -2);
+    lua_setmetatable(L, -2);
+}
+
+void *stack::to_object(lua_State *L, int idx, const void *key, const char *name) {
+    auto matches = false;
+    if (lua_type(L, idx) == LUA_TUSERDATA && lua_getmetatable(L, idx)) {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, key);
+        matches = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+    }
+    if (!matches)
+        throw luastate_error{std::string{"variable/field ["} + name + "] is not object of the requested class"};
+    return lua_touserdata(L, idx);
+}
+
+void *stack::method_self(lua_State *L) {
+    auto matches = false;
+    if (lua_type(L, 1) == LUA_TUSERDATA && lua_getmetatable(L, 1)) {
+        matches = lua_rawequal(L, -1, lua_upvalueindex(2));
+        lua_pop(L, 1);
+    }
+    if (!matches)
+        throw luastate_error{"argument #1 is not object of the bound class, call methods with ':'"};
+    return lua_touserdata(L, 1);
+}
+
+void *stack::userdata_at(lua_State *L, int idx) noexcept {
+    return lua_touserdata(L, idx);
+}
+
+void stack::push_ref(lua_State *L, int ref) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+}
+
+void stack::set_global(lua_State *L, const char *name) {
+    lua_setglobal(L, name);
+}
+
+void stack::set_field(lua_State *L, int tidx, const char *key) {
+    lua_setfield(L, tidx, key);
+}
+
+void stack::set_index(lua_State *L, int tidx, LuaInt n) {
+    lua_seti(L, tidx, n);
+}
+
+void stack::raw_set_index(lua_State *L, int tidx, LuaInt n) {
+    lua_rawseti(L, tidx, n);
+}
+
+void stack::raw_set(lua_State *L, int tidx) {
+    lua_rawset(L, tidx);
+}
+
+bool stack::next(lua_State *L, int tidx) {
+    return lua_next(L, tidx) != 0;
+}
+
+template<class T>
+void stack::push_array(lua_State *L, T *data, size_t size, const std::shared_ptr<T> &owner) {
+    auto ud = static_cast<array_userdata<T> *>(lua_newuserdata(L, sizeof(array_userdata<T>)));
+    new (ud) array_userdata<T>{data, size, owner};
+    push_array_meta<T>(L);
+    lua_setmetatable(L, -2);
+}
+
+template<class T>
+T *stack::to_array(lua_State *L, int idx, const char *name, size_t &size, std::shared_ptr<T> &owner) {
+    auto ud = static_cast<array_userdata<T> *>(lua_touserdata(L, idx));
+    auto matches = false;
+    if (ud && lua_getmetatable(L, idx)) {
+        push_array_meta<T>(L);
+        matches = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+    }
+    if (!matches)
+        throw luastate_error{std::string{"variable/field ["} + name + "] is not " + array_meta<T>::name};
+    size = ud->size;
+    owner = ud->owner;
+    return ud->data;
+}
+
+// EXPLICIT INSTANTIATION for element types
+template void stack::push_array(lua_State *, double *, size_t, const std::shared_ptr<double> &);
+template void stack::push_array(lua_State *, float *, size_t, const std::shared_ptr<float> &);
+template void stack::push_array(lua_State *, std::int64_t *, size_t, const std::shared_ptr<std::int64_t> &);
+template void stack::push_array(lua_State *, std::int32_t *, size_t, const std::shared_ptr<std::int32_t> &);
+template double *stack::to_array(lua_State *, int, const char *, size_t &, std::shared_ptr<double> &);
+template float *stack::to_array(lua_State *, int, const char *, size_t &, std::shared_ptr<float> &);
+template std::int64_t *stack::to_array(lua_State *, int, const char *, size_t &, std::shared_ptr<std::int64_t> &);
+template std::int32_t *stack::to_array(lua_State *, int, const char *, size_t &, std::shared_ptr<std::int32_t> &);
+
+shared_value shared_value::boolean(bool value) noexcept {
+    auto result = shared_value{};
+    result.tag = types::BOOL;
+    result.b = value;
+    return result;
+}
+
+shared_value shared_value::integer(LuaInt value) noexcept {
+    auto result = shared_value{};
+    result.tag = types::INT;
+    result.i = value;
+    return result;
+}
+
+shared_value shared_value::number(double value) noexcept {
+    auto result = shared_value{};
+    result.tag = types::NUM;
+    result.n = value;
+    return result;
+}
+
+shared_value shared_value::string(std::string value) {
+    auto result = shared_value{};
+    result.tag = types::STR;
+    result.obj = std::make_shared<const std::string>(std::move(value));
+    return result;
+}
+
+shared_value shared_value::table(array_type array, fields_type fields) {
+    auto data = std::make_shared<table_data>();
+    data->array = std::move(array);
+    data->fields.reserve(fields.size());
+    for (auto &field : fields)
+        data->fields.emplace_back(field.first, std::move(field.second));
+    auto result = shared_value{};
+    result.tag = types::TABLE;
+    result.obj = std::move(data);
+    return result;
+}
+
+const std::string &shared_value::as_str() const noexcept {
+    return *static_cast<const std::string *>(obj.get());
+}
+
+size_t shared_value::size() const noexcept {
+    return tag == types::TABLE ? static_cast<const table_data *>(obj.get())->array.size() : 0;
+}
+
+const shared_value &shared_value::at(size_t idx) const {
+    if (idx >= size())
+        throw std::out_of_range{"shared_value::at"};
+    return static_cast<const table_data *>(obj.get())->array[idx];
+}
+
+const shared_value &shared_value::get(const std::string &key) const {
+    static const auto nil = shared_value{};
+    if (tag != types::TABLE)
+        return nil;
+    auto table = static_cast<const table_data *>(obj.get());
+    auto pos = table->find(key.data(), key.size());
+    return pos == table->fields.size() ? nil : table->fields[pos].second;
+}
+
+void stack::push_shared(lua_State *L, const shared_value &value) {
+    switch (value.type()) {
+    case types::BOOL:
+        lua_pushboolean(L, value.as_bool());
+        return;
+    case types::INT:
+        lua_pushinteger(L, value.as_int());
+        return;
+    case types::NUM:
+        lua_pushnumber(L, value.as_num());
+        return;
+    case types::STR:
+        lua_pushlstring(L, value.as_str().data(), value.as_str().size());
+        return;
+    case types::TABLE:
+        break;
+    default:
+        lua_pushnil(L);
+        return;
+    }
+    push_shared_cache(L);
+    if (lua_rawgetp(L, -1, value.identity()) != LUA_TNIL) {
+        lua_remove(L, -2);
+        return;
+    }
+    lua_pop(L, 1);
+    auto ud = static_cast<shared_proxy *>(lua_newuserdata(L, sizeof(shared_proxy)));
+    new (ud) shared_proxy{value};
+    push_shared_meta(L);
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, -3, value.identity());
+    lua_remove(L, -2);
+}
+
+shared_value stack::to_shared(lua_State *L, int idx, const char *name) {
+    return shared_builder{L, {}, {}}.build(idx, name);
+}
+
+namespace {
+    // most user space pointers fit in the low 48 bits
+    const int tag_shift = 48;
+    const std::uint64_t address_mask = (std::uint64_t{1} << tag_shift) - 1;
+
+    // the address of ptr_box_key identifies the metatable of boxed pointers in the registry
+    const char ptr_box_key = 0;
+
+    // a pointer whose top bits are in use
+    struct ptr_box {
+        const void *ptr;
+        std::uint16_t tag;
+    };
+
+    // the boxed pointer at idx, or NULL
+    ptr_box *to_ptr_box(lua_State *L, int idx) {
+        if (!lua_getmetatable(L, idx))
+            return nullptr;
+        lua_rawgetp(L, LUA_REGISTRYINDEX, &ptr_box_key);
+        auto boxed = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+        return boxed ? static_cast<ptr_box *>(lua_touserdata(L, idx)) : nullptr;
     }
+}
 
-    // assumes table is already in the stack at index tidx
-    // pop 0, push 0
-    auto table_len(int tidx) {
-        return get_what_impl<var_where::FUNC1, LuaInt>(lua_len, tidx, lua_tointegerx, lua_isinteger,
-            "integer");
+void stack::push_tagged(lua_State *L, const void *ptr, std::uint16_t tag) {
+    auto bits = static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(ptr));
+    if (!(bits & ~address_mask)) {
+        bits |= static_cast<std::uint64_t>(tag) << tag_shift;
+        lua_pushlightuserdata(L, reinterpret_cast<void *>(static_cast<std::uintptr_t>(bits)));
+        return;
     }
-
-    void protect_indexing(int idx) {
-        if (!(get_top_idx() >= idx))
-            throw luastate_error{"Malformed Lua stack indexing"};
+    if (!lua_checkstack(L, 3))
+        throw luastate_error{"cannot grow Lua stack: out of memory"};
+    new (lua_newuserdata(L, sizeof(ptr_box))) ptr_box{ptr, tag};
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &ptr_box_key) == LUA_TNIL) {
+        lua_pop(L, 1);
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "tagged pointer");
+        lua_setfield(L, -2, "__name");
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &ptr_box_key);
     }
+    lua_setmetatable(L, -2);
+}
 
-    ~impl() {
-        if (L)
-            lua_close(L);
+void *stack::to_tagged(lua_State *L, int idx, std::uint16_t tag, bool to_const, const char *name) {
+    auto matches = [&](std::uint16_t got) { return got == tag || (to_const && got == (tag | const_tag)); };
+    if (lua_type(L, idx) == LUA_TLIGHTUSERDATA) {
+        auto bits = static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(lua_touserdata(L, idx)));
+        if (matches(static_cast<std::uint16_t>(bits >> tag_shift)))
+            return reinterpret_cast<void *>(static_cast<std::uintptr_t>(bits & address_mask));
+    } else if (lua_type(L, idx) == LUA_TUSERDATA) {
+        if (!lua_checkstack(L, 2))
+            throw luastate_error{"cannot grow Lua stack: out of memory"};
+        auto box = to_ptr_box(L, idx);
+        if (box && matches(box->tag))
+            return const_cast<void *>(box->ptr);
     }
-};
+    throw luastate_error{std::string{"variable/field ["} + name + "] is not pointer of the requested type"};
+}
 
-// int param is ignored
-template<>
-void lua_interpreter::impl::get_by_key<var_where::GLOBAL>(keytype_t<var_where::GLOBAL> keyname, int) {
-    lua_getglobal(L, keyname);
+LuaInt stack::to_integer(lua_State *L, int idx, const char *name) {
+    if (!lua_isinteger(L, idx))
+        throw luastate_error{std::string{"variable/field ["} + name + "] is not integer"};
+    return lua_tointeger(L, idx);
 }
 
-// assumes table is already on the stack at index tidx
-template<>
-void lua_interpreter::impl::get_by_key<var_where::TABLE>(keytype_t<var_where::TABLE> keyname, int tidx) {
-    protect_indexing(tidx);
-    lua_getfield(L, tidx, keyname);
+double stack::to_number(lua_State *L, int idx, const char *name) {
+    auto isnum = int{};
+    auto result = lua_tonumberx(L, idx, &isnum);
+    if (!isnum)
+        throw luastate_error{std::string{"variable/field ["} + name + "] is not number or string convertible to number"};
+    return result;
 }
 
-// assumes table is already on the stack at index tidx
-template<>
-void lua_interpreter::impl::get_by_key<var_where::TABLE_INDEX>(keytype_t<var_where::TABLE_INDEX> keyidx, int tidx) {
-    protect_indexing(tidx);
-    lua_geti(L, tidx, keyidx);
+bool stack::to_boolean(lua_State *L, int idx, const char *name) {
+    if (!lua_isboolean(L, idx))
+        throw luastate_error{std::string{"variable/field ["} + name + "] is not boolean"};
+    return lua_toboolean(L, idx);
 }
 
-// key is a function
-// calls function
-template<>
-void lua_interpreter::impl::get_by_key<var_where::FUNC1>(keytype_t<var_where::FUNC1> f, int tidx) {
-    protect_indexing(tidx);
-    f(L, tidx);
+const char *stack::to_string(lua_State *L, int idx, const char *name, size_t &len) {
+    if (!lua_isstring(L, idx))
+        throw luastate_error{std::string{"variable/field ["} + name + "] is not string or number"};
+    return lua_tolstring(L, idx, &len);
+}
+
+void stack::check_table(lua_State *L, int idx, const char *name) {
+    if (!lua_istable(L, idx))
+        throw luastate_error{std::string{"variable/field ["} + name + "] is not table"};
+}
+
+LuaInt stack::table_len(lua_State *L, int idx, const char *name) {
+    check_table(L, idx, name);
+    return static_cast<LuaInt>(lua_rawlen(L, idx));
 }
 
 const int lua_interpreter::lua_version {LUA_VERSION_NUM};
@@ -219,6 +2765,10 @@ lua_interpreter::lua_interpreter()
 lua_interpreter::lua_interpreter(lua_interpreter &&) noexcept = default;
 lua_interpreter &lua_interpreter::operator=(lua_interpreter &&) noexcept = default;
 
+lua_State *lua_interpreter::lua_state() const noexcept {
+    return pimpl->L;
+}
+
 void lua_interpreter::openlibs() noexcept {
     return pimpl->openlibs();
 }
@@ -227,6 +2777,20 @@ std::tuple<bool, std::string> lua_interpreter::run_chunk(const char *code) noexc
     return pimpl->run_chunk(code);
 }
 
+void lua_interpreter::set_traceback(std::size_t max_frames) {
+    auto &trace = pimpl->trace;
+    trace.frames.resize(max_frames);
+    trace.frames.shrink_to_fit();
+    trace.count = 0;
+}
+
+std::string lua_interpreter::traceback() const {
+    std::string out;
+    if (pimpl->trace.count > 0)
+        format_trace(pimpl->trace, out);
+    return out;
+}
+
 template<types Type>
 get_var_t<Type> lua_interpreter::get_global(keytype_t<var_where::GLOBAL> varname) {
     return pimpl->get_what<var_where::GLOBAL, Type>(varname, IGNORED);
@@ -244,6 +2808,336 @@ table_handle lua_interpreter::get_global<types::TABLE>(keytype_t<var_where::GLOB
     return {pimpl, nullptr};
 }
 
+template<>
+string_handle lua_interpreter::get_global<types::STRVIEW>(keytype_t<var_where::GLOBAL> varname) {
+    auto len = size_t{};
+    auto str = pimpl->push_string<var_where::GLOBAL>(varname, IGNORED, len);
+    return {pimpl, nullptr, str, len};
+}
+
+template<types Type>
+void lua_interpreter::set_global(keytype_t<var_where::GLOBAL> varname, set_var_t<Type> value) {
+    pimpl->set_what<var_where::GLOBAL, Type>(varname, IGNORED, value);
+}
+// EXPLICIT INSTANTIATION for basic types
+template void lua_interpreter::set_global<types::INT>(keytype_t<var_where::GLOBAL>, set_var_t<types::INT>);
+template void lua_interpreter::set_global<types::NUM>(keytype_t<var_where::GLOBAL>, set_var_t<types::NUM>);
+template void lua_interpreter::set_global<types::STR>(keytype_t<var_where::GLOBAL>, set_var_t<types::STR>);
+template void lua_interpreter::set_global<types::BOOL>(keytype_t<var_where::GLOBAL>, set_var_t<types::BOOL>);
+template void lua_interpreter::set_global<types::NIL>(keytype_t<var_where::GLOBAL>, set_var_t<types::NIL>);
+
+table_handle lua_interpreter::new_table(int narr, int nrec) {
+    pimpl->reserve_stack(1);
+    lua_createtable(pimpl->L, narr, nrec);
+    return {pimpl, nullptr};
+}
+
+table_builder lua_interpreter::build_table(int narr, int nrec) {
+    return table_builder{new_table(narr, nrec)};
+}
+
+key_token::key_token(std::shared_ptr<lua_interpreter::impl> state, int ref, std::string name)
+    : pstate{std::move(state)}, key_ref{ref}, key_name{std::move(name)}
+{}
+
+key_token::key_token(key_token &&other) noexcept
+    : pstate{std::move(other.pstate)}, key_ref{other.key_ref}, key_name{std::move(other.key_name)}
+{}
+
+key_token &key_token::operator=(key_token &&other) noexcept {
+    if (this != &other) {
+        release();
+        pstate = std::move(other.pstate);
+        key_ref = other.key_ref;
+        key_name = std::move(other.key_name);
+    }
+    return *this;
+}
+
+key_token::~key_token() {
+    release();
+}
+
+void key_token::release() noexcept {
+    if (pstate)
+        luaL_unref(pstate->L, LUA_REGISTRYINDEX, key_ref);
+    pstate.reset();
+}
+
+key_token lua_interpreter::make_key(const char *name) {
+    auto ref = pimpl->make_key(name);
+    try {
+        return {pimpl, ref, name};
+    } catch (...) {
+        luaL_unref(pimpl->L, LUA_REGISTRYINDEX, ref);
+        throw;
+    }
+}
+
+function_ref lua_interpreter::get_function(const char *varname) {
+    pimpl->reserve_stack(1);
+    lua_getglobal(pimpl->L, varname);
+    if (!lua_isfunction(pimpl->L, -1)) {
+        lua_pop(pimpl->L, 1);
+        throw luastate_error{std::string{"variable/field ["} + varname + "] is not function"};
+    }
+    return function_ref{pimpl};
+}
+
+void lua_interpreter::register_function(const char *varname, stack::c_function fn) {
+    pimpl->reserve_stack(1);
+    lua_pushcfunction(pimpl->L, fn);
+    lua_setglobal(pimpl->L, varname);
+}
+
+void lua_interpreter::register_function(const char *varname, stack::c_function fn, const void *data, size_t size) {
+    stack::push_closure(pimpl->L, fn, data, size);
+    lua_setglobal(pimpl->L, varname);
+}
+
+function_ref::function_ref(std::shared_ptr<lua_interpreter::impl> interp_impl)
+    : pstate{std::move(interp_impl)}, L{pstate->L}, ref{luaL_ref(L, LUA_REGISTRYINDEX)}
+{}
+
+function_ref::function_ref(function_ref &&other) noexcept
+    : pstate{std::move(other.pstate)}, L{other.L}, ref{other.ref}
+{
+    other.L = nullptr;
+}
+
+function_ref &function_ref::operator=(function_ref &&other) noexcept {
+    if (this != &other) {
+        release();
+        pstate = std::move(other.pstate);
+        L = other.L;
+        ref = other.ref;
+        other.L = nullptr;
+    }
+    return *this;
+}
+
+function_ref::~function_ref() {
+    release();
+}
+
+void function_ref::release() noexcept {
+    if (L)
+        luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    L = nullptr;
+}
+
+coroutine lua_interpreter::new_coroutine(const char *fname) {
+    pimpl->reserve_stack(2);
+    lua_getglobal(pimpl->L, fname);
+    if (!lua_isfunction(pimpl->L, -1)) {
+        lua_pop(pimpl->L, 1);
+        throw luastate_error{std::string{"variable/field ["} + fname + "] is not function"};
+    }
+    return coroutine{pimpl};
+}
+
+coroutine lua_interpreter::new_coroutine(const function_ref &f) {
+    if (!f || f.pstate != pimpl)
+        throw luastate_error{"function_ref is empty or belongs to another interpreter"};
+    pimpl->reserve_stack(2);
+    lua_rawgeti(pimpl->L, LUA_REGISTRYINDEX, f.ref);
+    return coroutine{pimpl};
+}
+
+coroutine::coroutine(std::shared_ptr<lua_interpreter::impl> interp_impl)
+    : pstate{std::move(interp_impl)}, L{pstate->L}, co{nullptr}, ref{LUA_NOREF}, st{co_status::SUSPENDED}, nvalues{0}
+{
+    auto &threads = pstate->threads;
+    if (threads.empty()) {
+        co = lua_newthread(L);
+        ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    } else {
+        co = threads.back().co;
+        ref = threads.back().ref;
+        threads.pop_back();
+    }
+    // a pooled thread is empty, a new one has room for LUA_MINSTACK values
+    lua_xmove(L, co, 1);
+}
+
+coroutine::coroutine(coroutine &&other) noexcept
+    : pstate{std::move(other.pstate)}, L{other.L}, co{other.co}, ref{other.ref}, st{other.st}, nvalues{other.nvalues}
+{
+    other.co = nullptr;
+}
+
+coroutine &coroutine::operator=(coroutine &&other) noexcept {
+    if (this != &other) {
+        release();
+        pstate = std::move(other.pstate);
+        L = other.L;
+        co = other.co;
+        ref = other.ref;
+        st = other.st;
+        nvalues = other.nvalues;
+        other.co = nullptr;
+    }
+    return *this;
+}
+
+coroutine::~coroutine() {
+    release();
+}
+
+void coroutine::release() noexcept {
+    if (!co)
+        return;
+    // only a thread that is not inside a function can be reused
+    if (lua_status(co) == LUA_OK) {
+        lua_settop(co, 0);
+        try {
+            pstate->threads.push_back({co, ref});
+        } catch (const std::bad_alloc &) {
+            luaL_unref(L, LUA_REGISTRYINDEX, ref);
+        }
+    } else {
+        luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    }
+    co = nullptr;
+}
+
+co_status coroutine::resume_with(int nargs) {
+    pstate->trace.count = 0;
+    // drop the values of the last yield, the arguments become the results of coroutine.yield()
+    if (lua_status(co) == LUA_YIELD)
+        lua_settop(co, 0);
+    if (!lua_checkstack(co, nargs)) {
+        lua_pop(L, nargs);
+        throw luastate_error{"cannot grow Lua stack: out of memory"};
+    }
+    lua_xmove(L, co, nargs);
+    switch (lua_resume(co, L, nargs)) {
+    case LUA_OK:
+        st = co_status::DONE;
+        nvalues = lua_gettop(co);
+        break;
+    case LUA_YIELD:
+        st = co_status::SUSPENDED;
+        nvalues = lua_gettop(co);
+        break;
+    default:
+        // the stack of a failed thread is left as it was, so the frames can still be recorded
+        st = co_status::ERROR;
+        nvalues = 0;
+        if (!pstate->trace.frames.empty())
+            record_trace(co, 0, pstate->trace);
+    }
+    return st;
+}
+
+std::string coroutine::error() const {
+    if (st != co_status::ERROR)
+        return {};
+    auto msg = lua_tostring(co, -1);
+    return msg ? msg : "(error object is not a string)";
+}
+
+void lua_interpreter::open_msgpack() noexcept {
+    luaL_requiref(pimpl->L, "msgpack", open_msgpack_module, 1);
+    lua_pop(pimpl->L, 1);
+}
+
+void lua_interpreter::pack_global(const char *varname, std::string &buf) {
+    auto L = pimpl->L;
+    pimpl->reserve_stack(1);
+    lua_getglobal(L, varname);
+    pack_value(L, lua_gettop(L), buf, varname);
+    lua_pop(L, 1);
+}
+
+void lua_interpreter::unpack_global(const char *varname, const char *data, size_t len) {
+    unpack_value(pimpl->L, data, len);
+    lua_setglobal(pimpl->L, varname);
+}
+
+void luai::copy_value(lua_interpreter &src, const char *path, lua_interpreter &dst, const char *name) {
+    auto from = src.lua_state();
+    auto to = dst.lua_state();
+    if (from == to)
+        throw luastate_error{"copy_value() needs two different interpreters"};
+    src.pimpl->reserve_stack(2);
+    dst.pimpl->reserve_stack(2);
+    auto fromtop = lua_gettop(from);
+    auto totop = lua_gettop(to);
+    try {
+        // the global, then one field for each dot
+        auto dot = std::strchr(path, '.');
+        auto part = std::string{path, dot ? dot : path + std::strlen(path)};
+        lua_getglobal(from, part.c_str());
+        while (dot) {
+            if (!lua_istable(from, -1))
+                throw luastate_error{"variable/field [" + part + "] is not table"};
+            auto next = dot + 1;
+            dot = std::strchr(next, '.');
+            part.assign(next, dot ? dot : next + std::strlen(next));
+            lua_getfield(from, -1, part.c_str());
+            lua_remove(from, -2);
+        }
+        lua_newtable(to);
+        value_copier{from, to, lua_gettop(to), {}}.copy(lua_gettop(from), path);
+        lua_setglobal(to, name);
+        lua_settop(from, fromtop);
+        lua_settop(to, totop);
+    } catch (...) {
+        lua_settop(from, fromtop);
+        lua_settop(to, totop);
+        throw;
+    }
+}
+
+void lua_interpreter::open_json() noexcept {
+    luaL_requiref(pimpl->L, "json", open_json_module, 1);
+    lua_pop(pimpl->L, 1);
+}
+
+table_handle lua_interpreter::from_json(const char *text, size_t len) {
+    auto L = pimpl->L;
+    decode_json(L, text, len);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        throw luastate_error{"cannot decode JSON: not an object or array"};
+    }
+    return {pimpl, nullptr};
+}
+
+template<types Type>
+get_result<Type> lua_interpreter::try_get_global(keytype_t<var_where::GLOBAL> varname) {
+    auto err = get_error::NONE;
+    auto result = pimpl->get_what<var_where::GLOBAL, Type>(varname, IGNORED, &err);
+    if (err != get_error::NONE)
+        return {err};
+    return {std::move(result)};
+}
+// EXPLICIT INSTANTIATION for basic types
+template get_result<types::INT> lua_interpreter::try_get_global<types::INT>(keytype_t<var_where::GLOBAL>);
+template get_result<types::NUM> lua_interpreter::try_get_global<types::NUM>(keytype_t<var_where::GLOBAL>);
+template get_result<types::STR> lua_interpreter::try_get_global<types::STR>(keytype_t<var_where::GLOBAL>);
+template get_result<types::BOOL> lua_interpreter::try_get_global<types::BOOL>(keytype_t<var_where::GLOBAL>);
+
+template<>
+get_result<types::TABLE> lua_interpreter::try_get_global<types::TABLE>(keytype_t<var_where::GLOBAL> varname) {
+    auto err = get_error::NONE;
+    pimpl->push_table<var_where::GLOBAL>(varname, IGNORED, &err);
+    if (err != get_error::NONE)
+        return {err};
+    return {table_handle{pimpl, nullptr}};
+}
+
+template<>
+get_result<types::STRVIEW> lua_interpreter::try_get_global<types::STRVIEW>(keytype_t<var_where::GLOBAL> varname) {
+    auto err = get_error::NONE;
+    auto len = size_t{};
+    auto str = pimpl->push_string<var_where::GLOBAL>(varname, IGNORED, len, &err);
+    if (err != get_error::NONE)
+        return {err};
+    return {string_handle{pimpl, nullptr, str, len}};
+}
+
 struct table_handle::impl {
     std::shared_ptr<lua_interpreter::impl> pstate;
     // own a reference to the parent impl to avoid popping stack even if parent itself is freed
@@ -280,6 +3174,21 @@ table_handle::table_handle(std::shared_ptr<lua_interpreter::impl> interp_impl, s
 table_handle::table_handle(table_handle &&) noexcept = default;
 table_handle &table_handle::operator=(table_handle &&) noexcept = default;
 
+// defined here as it needs table_handle::impl
+template<>
+void lua_interpreter::set_global<types::TABLE>(keytype_t<var_where::GLOBAL> varname, set_var_t<types::TABLE> value) {
+    pimpl->set_table<var_where::GLOBAL>(varname, IGNORED, value.pimpl->pstate.get(), value.pimpl->stack_index);
+}
+
+lua_State *table_handle::checked_state() {
+    pimpl->pstate->protect_indexing(pimpl->stack_index);
+    return pimpl->pstate->L;
+}
+
+int table_handle::stack_index() const noexcept {
+    return pimpl->stack_index;
+}
+
 template<types Type>
 get_var_t<Type> table_handle::get_field(keytype_t<var_where::TABLE> varname) {
     return pimpl->pstate->get_what<var_where::TABLE, Type>(varname, pimpl->stack_index);
@@ -298,6 +3207,124 @@ table_handle table_handle::get_field<types::TABLE>(keytype_t<var_where::TABLE> v
     return {pimpl->pstate, pimpl};
 }
 
+template<>
+string_handle table_handle::get_field<types::STRVIEW>(keytype_t<var_where::TABLE> varname) {
+    auto len = size_t{};
+    auto str = pimpl->pstate->push_string<var_where::TABLE>(varname, pimpl->stack_index, len);
+    return {pimpl->pstate, pimpl, str, len};
+}
+
+template<types Type>
+get_var_t<Type> table_handle::get_field(keytype_t<var_where::TABLE_KEY> key) {
+    return pimpl->pstate->get_what<var_where::TABLE_KEY, Type>(key, pimpl->stack_index);
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template get_var_t<types::INT> table_handle::get_field<types::INT>(keytype_t<var_where::TABLE_KEY>);
+template get_var_t<types::NUM> table_handle::get_field<types::NUM>(keytype_t<var_where::TABLE_KEY>);
+template get_var_t<types::STR> table_handle::get_field<types::STR>(keytype_t<var_where::TABLE_KEY>);
+template get_var_t<types::BOOL> table_handle::get_field<types::BOOL>(keytype_t<var_where::TABLE_KEY>);
+template get_var_t<types::LTYPE> table_handle::get_field<types::LTYPE>(keytype_t<var_where::TABLE_KEY>);
+
+template<>
+table_handle table_handle::get_field<types::TABLE>(keytype_t<var_where::TABLE_KEY> key) {
+    pimpl->pstate->push_table<var_where::TABLE_KEY>(key, pimpl->stack_index);
+    return {pimpl->pstate, pimpl};
+}
+
+template<>
+string_handle table_handle::get_field<types::STRVIEW>(keytype_t<var_where::TABLE_KEY> key) {
+    auto len = size_t{};
+    auto str = pimpl->pstate->push_string<var_where::TABLE_KEY>(key, pimpl->stack_index, len);
+    return {pimpl->pstate, pimpl, str, len};
+}
+
+template<types Type>
+get_result<Type> table_handle::try_get_field(keytype_t<var_where::TABLE> varname) {
+    if (!pimpl->pstate->valid_indexing(pimpl->stack_index))
+        return {get_error::BAD_INDEX};
+    auto err = get_error::NONE;
+    auto result = pimpl->pstate->get_what<var_where::TABLE, Type>(varname, pimpl->stack_index, &err);
+    if (err != get_error::NONE)
+        return {err};
+    return {std::move(result)};
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template get_result<types::INT> table_handle::try_get_field<types::INT>(keytype_t<var_where::TABLE>);
+template get_result<types::NUM> table_handle::try_get_field<types::NUM>(keytype_t<var_where::TABLE>);
+template get_result<types::STR> table_handle::try_get_field<types::STR>(keytype_t<var_where::TABLE>);
+template get_result<types::BOOL> table_handle::try_get_field<types::BOOL>(keytype_t<var_where::TABLE>);
+
+template<>
+get_result<types::TABLE> table_handle::try_get_field<types::TABLE>(keytype_t<var_where::TABLE> varname) {
+    if (!pimpl->pstate->valid_indexing(pimpl->stack_index))
+        return {get_error::BAD_INDEX};
+    auto err = get_error::NONE;
+    pimpl->pstate->push_table<var_where::TABLE>(varname, pimpl->stack_index, &err);
+    if (err != get_error::NONE)
+        return {err};
+    return {table_handle{pimpl->pstate, pimpl}};
+}
+
+template<>
+get_result<types::STRVIEW> table_handle::try_get_field<types::STRVIEW>(keytype_t<var_where::TABLE> varname) {
+    if (!pimpl->pstate->valid_indexing(pimpl->stack_index))
+        return {get_error::BAD_INDEX};
+    auto err = get_error::NONE;
+    auto len = size_t{};
+    auto str = pimpl->pstate->push_string<var_where::TABLE>(varname, pimpl->stack_index, len, &err);
+    if (err != get_error::NONE)
+        return {err};
+    return {string_handle{pimpl->pstate, pimpl, str, len}};
+}
+
+template<types Type>
+get_result<Type> table_handle::try_get_field(keytype_t<var_where::TABLE_KEY> key) {
+    if (!pimpl->pstate->valid_indexing(pimpl->stack_index))
+        return {get_error::BAD_INDEX};
+    if (key.owner() != pimpl->pstate.get())
+        return {get_error::BAD_KEY};
+    auto err = get_error::NONE;
+    auto result = pimpl->pstate->get_what<var_where::TABLE_KEY, Type>(key, pimpl->stack_index, &err);
+    if (err != get_error::NONE)
+        return {err};
+    return {std::move(result)};
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template get_result<types::INT> table_handle::try_get_field<types::INT>(keytype_t<var_where::TABLE_KEY>);
+template get_result<types::NUM> table_handle::try_get_field<types::NUM>(keytype_t<var_where::TABLE_KEY>);
+template get_result<types::STR> table_handle::try_get_field<types::STR>(keytype_t<var_where::TABLE_KEY>);
+template get_result<types::BOOL> table_handle::try_get_field<types::BOOL>(keytype_t<var_where::TABLE_KEY>);
+
+template<>
+get_result<types::TABLE> table_handle::try_get_field<types::TABLE>(keytype_t<var_where::TABLE_KEY> key) {
+    if (!pimpl->pstate->valid_indexing(pimpl->stack_index))
+        return {get_error::BAD_INDEX};
+    if (key.owner() != pimpl->pstate.get())
+        return {get_error::BAD_KEY};
+    auto err = get_error::NONE;
+    pimpl->pstate->push_table<var_where::TABLE_KEY>(key, pimpl->stack_index, &err);
+    if (err != get_error::NONE)
+        return {err};
+    return {table_handle{pimpl->pstate, pimpl}};
+}
+
+template<>
+get_result<types::STRVIEW> table_handle::try_get_field<types::STRVIEW>(keytype_t<var_where::TABLE_KEY> key) {
+    if (!pimpl->pstate->valid_indexing(pimpl->stack_index))
+        return {get_error::BAD_INDEX};
+    if (key.owner() != pimpl->pstate.get())
+        return {get_error::BAD_KEY};
+    auto err = get_error::NONE;
+    auto len = size_t{};
+    auto str = pimpl->pstate->push_string<var_where::TABLE_KEY>(key, pimpl->stack_index, len, &err);
+    if (err != get_error::NONE)
+        return {err};
+    return {string_handle{pimpl->pstate, pimpl, str, len}};
+}
+
 template<types Type>
 get_var_t<Type> table_handle::get_index(keytype_t<var_where::TABLE_INDEX> idx) {
     return pimpl->pstate->get_what<var_where::TABLE_INDEX, Type>(idx, pimpl->stack_index);
@@ -316,6 +3343,185 @@ table_handle table_handle::get_index<types::TABLE>(keytype_t<var_where::TABLE_IN
     return {pimpl->pstate, pimpl};
 }
 
+template<>
+string_handle table_handle::get_index<types::STRVIEW>(keytype_t<var_where::TABLE_INDEX> idx) {
+    auto len = size_t{};
+    auto str = pimpl->pstate->push_string<var_where::TABLE_INDEX>(idx, pimpl->stack_index, len);
+    return {pimpl->pstate, pimpl, str, len};
+}
+
+template<types Type>
+get_result<Type> table_handle::try_get_index(keytype_t<var_where::TABLE_INDEX> idx) {
+    if (!pimpl->pstate->valid_indexing(pimpl->stack_index))
+        return {get_error::BAD_INDEX};
+    auto err = get_error::NONE;
+    auto result = pimpl->pstate->get_what<var_where::TABLE_INDEX, Type>(idx, pimpl->stack_index, &err);
+    if (err != get_error::NONE)
+        return {err};
+    return {std::move(result)};
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template get_result<types::INT> table_handle::try_get_index<types::INT>(keytype_t<var_where::TABLE_INDEX>);
+template get_result<types::NUM> table_handle::try_get_index<types::NUM>(keytype_t<var_where::TABLE_INDEX>);
+template get_result<types::STR> table_handle::try_get_index<types::STR>(keytype_t<var_where::TABLE_INDEX>);
+template get_result<types::BOOL> table_handle::try_get_index<types::BOOL>(keytype_t<var_where::TABLE_INDEX>);
+
+template<>
+get_result<types::TABLE> table_handle::try_get_index<types::TABLE>(keytype_t<var_where::TABLE_INDEX> idx) {
+    if (!pimpl->pstate->valid_indexing(pimpl->stack_index))
+        return {get_error::BAD_INDEX};
+    auto err = get_error::NONE;
+    pimpl->pstate->push_table<var_where::TABLE_INDEX>(idx, pimpl->stack_index, &err);
+    if (err != get_error::NONE)
+        return {err};
+    return {table_handle{pimpl->pstate, pimpl}};
+}
+
+template<>
+get_result<types::STRVIEW> table_handle::try_get_index<types::STRVIEW>(keytype_t<var_where::TABLE_INDEX> idx) {
+    if (!pimpl->pstate->valid_indexing(pimpl->stack_index))
+        return {get_error::BAD_INDEX};
+    auto err = get_error::NONE;
+    auto len = size_t{};
+    auto str = pimpl->pstate->push_string<var_where::TABLE_INDEX>(idx, pimpl->stack_index, len, &err);
+    if (err != get_error::NONE)
+        return {err};
+    return {string_handle{pimpl->pstate, pimpl, str, len}};
+}
+
+template<types Type>
+void table_handle::set_field(keytype_t<var_where::TABLE> varname, set_var_t<Type> value) {
+    pimpl->pstate->set_what<var_where::TABLE, Type>(varname, pimpl->stack_index, value);
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template void table_handle::set_field<types::INT>(keytype_t<var_where::TABLE>, set_var_t<types::INT>);
+template void table_handle::set_field<types::NUM>(keytype_t<var_where::TABLE>, set_var_t<types::NUM>);
+template void table_handle::set_field<types::STR>(keytype_t<var_where::TABLE>, set_var_t<types::STR>);
+template void table_handle::set_field<types::BOOL>(keytype_t<var_where::TABLE>, set_var_t<types::BOOL>);
+template void table_handle::set_field<types::NIL>(keytype_t<var_where::TABLE>, set_var_t<types::NIL>);
+
+template<>
+void table_handle::set_field<types::TABLE>(keytype_t<var_where::TABLE> varname, set_var_t<types::TABLE> value) {
+    pimpl->pstate->set_table<var_where::TABLE>(varname, pimpl->stack_index,
+        value.pimpl->pstate.get(), value.pimpl->stack_index);
+}
+
+template<types Type>
+void table_handle::set_field(keytype_t<var_where::TABLE_KEY> key, set_var_t<Type> value) {
+    pimpl->pstate->set_what<var_where::TABLE_KEY, Type>(key, pimpl->stack_index, value);
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template void table_handle::set_field<types::INT>(keytype_t<var_where::TABLE_KEY>, set_var_t<types::INT>);
+template void table_handle::set_field<types::NUM>(keytype_t<var_where::TABLE_KEY>, set_var_t<types::NUM>);
+template void table_handle::set_field<types::STR>(keytype_t<var_where::TABLE_KEY>, set_var_t<types::STR>);
+template void table_handle::set_field<types::BOOL>(keytype_t<var_where::TABLE_KEY>, set_var_t<types::BOOL>);
+template void table_handle::set_field<types::NIL>(keytype_t<var_where::TABLE_KEY>, set_var_t<types::NIL>);
+
+template<>
+void table_handle::set_field<types::TABLE>(keytype_t<var_where::TABLE_KEY> key, set_var_t<types::TABLE> value) {
+    pimpl->pstate->set_table<var_where::TABLE_KEY>(key, pimpl->stack_index,
+        value.pimpl->pstate.get(), value.pimpl->stack_index);
+}
+
+template<types Type>
+void table_handle::set_index(keytype_t<var_where::TABLE_INDEX> idx, set_var_t<Type> value) {
+    pimpl->pstate->set_what<var_where::TABLE_INDEX, Type>(idx, pimpl->stack_index, value);
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template void table_handle::set_index<types::INT>(keytype_t<var_where::TABLE_INDEX>, set_var_t<types::INT>);
+template void table_handle::set_index<types::NUM>(keytype_t<var_where::TABLE_INDEX>, set_var_t<types::NUM>);
+template void table_handle::set_index<types::STR>(keytype_t<var_where::TABLE_INDEX>, set_var_t<types::STR>);
+template void table_handle::set_index<types::BOOL>(keytype_t<var_where::TABLE_INDEX>, set_var_t<types::BOOL>);
+template void table_handle::set_index<types::NIL>(keytype_t<var_where::TABLE_INDEX>, set_var_t<types::NIL>);
+
+template<>
+void table_handle::set_index<types::TABLE>(keytype_t<var_where::TABLE_INDEX> idx, set_var_t<types::TABLE> value) {
+    pimpl->pstate->set_table<var_where::TABLE_INDEX>(idx, pimpl->stack_index,
+        value.pimpl->pstate.get(), value.pimpl->stack_index);
+}
+
+int table_handle::push_fields(const char *const *varnames, int n) {
+    auto top = pimpl->pstate->get_top_idx();
+    pimpl->pstate->push_fields(varnames, n, pimpl->stack_index);
+    return top;
+}
+
+template<types Type>
+get_var_t<Type> table_handle::pop_field(keytype_t<var_where::PUSHED> varname) {
+    return pimpl->pstate->get_what<var_where::PUSHED, Type>(varname, IGNORED);
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template get_var_t<types::INT> table_handle::pop_field<types::INT>(keytype_t<var_where::PUSHED>);
+template get_var_t<types::NUM> table_handle::pop_field<types::NUM>(keytype_t<var_where::PUSHED>);
+template get_var_t<types::STR> table_handle::pop_field<types::STR>(keytype_t<var_where::PUSHED>);
+template get_var_t<types::BOOL> table_handle::pop_field<types::BOOL>(keytype_t<var_where::PUSHED>);
+template get_var_t<types::LTYPE> table_handle::pop_field<types::LTYPE>(keytype_t<var_where::PUSHED>);
+
+void table_handle::restore_top(int top) noexcept {
+    pimpl->pstate->restore_top(top);
+}
+
 LuaInt table_handle::len() {
     return pimpl->pstate->table_len(pimpl->stack_index);
 }
+
+function_ref table_handle::get_function(keytype_t<var_where::TABLE> varname) {
+    auto L = checked_state();
+    pimpl->pstate->reserve_stack(1);
+    lua_getfield(L, pimpl->stack_index, varname);
+    if (!lua_isfunction(L, -1)) {
+        lua_pop(L, 1);
+        throw luastate_error{std::string{"variable/field ["} + varname + "] is not function"};
+    }
+    return function_ref{pimpl->pstate};
+}
+
+void table_handle::pack(std::string &buf) {
+    pack_value(checked_state(), pimpl->stack_index, buf, "table");
+}
+
+void table_handle::to_json(std::string &buf) {
+    encode_json(checked_state(), pimpl->stack_index, buf, "table");
+}
+
+void value_traits<table_handle>::push(lua_State *L, const table_handle &value) {
+    auto &pimpl = value.pimpl;
+    if (!pimpl || pimpl->pstate->L != L)
+        throw luastate_error{"table handle belongs to another interpreter"};
+    pimpl->pstate->protect_indexing(pimpl->stack_index);
+    lua_pushvalue(L, pimpl->stack_index);
+}
+
+// must push the string on the top of the stack before constructing
+string_handle::string_handle(std::shared_ptr<lua_interpreter::impl> interp_impl,
+        std::shared_ptr<table_handle::impl> parent_impl, const char *str, size_t len)
+    : pin{std::make_shared<table_handle::impl>(std::move(interp_impl), std::move(parent_impl))}
+    , data_{str}, size_{len}
+{}
+
+string_handle::string_handle(string_handle &&) noexcept = default;
+string_handle &string_handle::operator=(string_handle &&) noexcept = default;
+
+table_builder::table_builder(table_handle &&table)
+    : handle{std::move(table)}, count{0}
+{}
+
+table_builder::table_builder(table_builder &&) noexcept = default;
+table_builder &table_builder::operator=(table_builder &&) noexcept = default;
+
+void table_builder::build_global(const char *varname) {
+    auto L = handle.checked_state();
+    lua_pushvalue(L, handle.pimpl->stack_index);
+    lua_setglobal(L, varname);
+    handle.pimpl.reset();
+}
+
+void table_builder::build_field(table_handle &parent, const char *varname) {
+    parent.set_field<types::TABLE>(varname, handle);
+    handle.pimpl.reset();
+}
@@ -1,9 +1,23 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <map>
 #include <memory>
+#include <new>
 #include <stdexcept>
 #include <string>
 #include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+
+struct lua_State;
 
 namespace luai {
 
@@ -13,10 +27,16 @@ class luastate_error : public std::runtime_error {
 
 enum class types {
     INT, NUM, STR, BOOL, TABLE,
-    NIL, OTHER, LTYPE
+    NIL, OTHER, LTYPE, STRVIEW
 };
 
 class table_handle;
+class string_handle;
+class table_builder;
+class function_ref;
+class key_token;
+class coroutine;
+class scheduler;
 
 // all possible types one can get from state.get_global(),  get_field() and get_index()
 template<types Type>
@@ -27,9 +47,842 @@ using get_var_t =
     std::conditional_t<Type == types::BOOL, bool,
     std::conditional_t<Type == types::TABLE, table_handle,
     std::conditional_t<Type == types::LTYPE, types,
+    std::conditional_t<Type == types::STRVIEW, string_handle,
+    /*unsupported types*/ luastate_error
+>>>>>>>;
+
+// all possible types one can set with state.set_global(), set_field() and set_index()
+// TABLE assigns an existing table, NIL removes the variable/field
+template<types Type>
+using set_var_t =
+    std::conditional_t<Type == types::INT, long long,
+    std::conditional_t<Type == types::NUM, double,
+    std::conditional_t<Type == types::STR, const std::string &,
+    std::conditional_t<Type == types::BOOL, bool,
+    std::conditional_t<Type == types::TABLE, const table_handle &,
+    std::conditional_t<Type == types::NIL, std::nullptr_t,
     /*unsupported types*/ luastate_error
 >>>>>>;
 
+// why try_get_global(), try_get_field() or try_get_index() returned no value
+enum class get_error {
+    NONE,       // there is a value
+    NIL,        // variable/field does not exist
+    WRONG_TYPE, // variable/field has another type
+    BAD_INDEX,  // the table handle is no longer on the lua stack
+    BAD_KEY     // the key_token was made by another interpreter
+};
+
+// either a value of get_var_t<Type> or a get_error, returned by the try_get_*() functions
+template<types Type>
+class get_result {
+public:
+    using value_type = get_var_t<Type>;
+
+    get_result(value_type &&value) : err{get_error::NONE}, val(std::move(value)) {}
+    get_result(get_error error) noexcept : err{error} {}
+
+    // MOVE
+    get_result(get_result &&other) : err{other.err} {
+        if (has_value())
+            new (&val) value_type(std::move(other.val));
+    }
+    get_result &operator=(get_result &&) = delete;
+
+    ~get_result() {
+        if (has_value())
+            val.~value_type();
+    }
+
+    bool has_value() const noexcept { return err == get_error::NONE; }
+    explicit operator bool() const noexcept { return has_value(); }
+    get_error error() const noexcept { return err; }
+
+    // must only be used if there is a value
+    value_type &operator*() noexcept { return val; }
+    value_type *operator->() noexcept { return &val; }
+
+    value_type value_or(value_type fallback) {
+        return has_value() ? std::move(val) : std::move(fallback);
+    }
+
+private:
+    get_error err;
+    union {
+        value_type val;
+    };
+};
+
+// whether values of this type are copied out, rather than kept on the lua stack by a handle
+constexpr bool is_value_type(types Type) {
+    return Type != types::TABLE && Type != types::STRVIEW;
+}
+
+// whether call() can return this type, converted with value_traits
+constexpr bool is_call_result(types Type) {
+    return Type == types::INT || Type == types::NUM || Type == types::STR || Type == types::BOOL;
+}
+
+// thin wrappers of the lua C API for the templates in this header, which work on raw lua_State
+// indices are absolute. functions reading values throw luastate_error if the value has another type,
+// "name" is only used to build the error message
+namespace stack {
+    int get_top(lua_State *L) noexcept;
+    void set_top(lua_State *L, int top) noexcept;
+    // makes room for n more values, throws if it cannot
+    void reserve(lua_State *L, int n);
+
+    void push_nil(lua_State *L);
+    void push_integer(lua_State *L, long long value);
+    void push_number(lua_State *L, double value);
+    void push_boolean(lua_State *L, bool value);
+    void push_string(lua_State *L, const char *str, std::size_t len);
+    void push_string(lua_State *L, const char *str);
+    void push_copy(lua_State *L, int idx);
+    // narr and nrec are the sizes of the array and hash parts to preallocate
+    void new_table(lua_State *L, int narr, int nrec);
+
+    // pop 0, push 1
+    void get_global(lua_State *L, const char *name);
+    void get_field(lua_State *L, int tidx, const char *key);
+    void get_index(lua_State *L, int tidx, long long n);
+    void raw_get_index(lua_State *L, int tidx, long long n);
+    void raw_get_field(lua_State *L, int tidx, const char *key);
+
+    // pop 1 (key), push 1
+    void raw_get(lua_State *L, int tidx);
+
+    // calls the function below the nargs arguments on the top in protected mode
+    // throws luastate_error with the lua error message if it fails
+    // pop nargs + 1, push nresults
+    void call(lua_State *L, int nargs, int nresults);
+
+    // pushes a value referenced from the registry
+    // pop 0, push 1
+    void push_ref(lua_State *L, int ref);
+
+    // pop 1, push 0
+    void set_global(lua_State *L, const char *name);
+    void set_field(lua_State *L, int tidx, const char *key);
+    void set_index(lua_State *L, int tidx, long long n);
+    void raw_set_index(lua_State *L, int tidx, long long n);
+    // pop 2 (key then value), push 0
+    void raw_set(lua_State *L, int tidx);
+
+    // iterates the table like lua_next(), pushing key and value if it returns true
+    bool next(lua_State *L, int tidx);
+
+    long long to_integer(lua_State *L, int idx, const char *name);
+    double to_number(lua_State *L, int idx, const char *name);
+    bool to_boolean(lua_State *L, int idx, const char *name);
+    const char *to_string(lua_State *L, int idx, const char *name, std::size_t &len);
+    void check_table(lua_State *L, int idx, const char *name);
+    // checks the value is a table and returns its raw length
+    long long table_len(lua_State *L, int idx, const char *name);
+} // namespace stack
+
+// how a C++ type is pushed to and read from the lua stack. specialize it for more types
+//   static void push(lua_State *L, const T &value) pushes exactly one value
+//   static T get(lua_State *L, int idx, const char *name) reads the value at absolute index idx.
+//     values pushed by get() may be left on the stack when it throws, callers restore the top
+template<class T, class Enable = void>
+struct value_traits;
+
+// describes the fields of a C++ struct so that it is converted from/to a lua table, e.g.
+//     namespace luai {
+//     template<> struct struct_schema<point> {
+//         static auto fields() { return std::make_tuple(field("x", &point::x), field("y", &point::y)); }
+//     };
+//     }
+// member types must have value_traits, including vectors and other structs with schemas.
+// the struct must be default constructible
+template<class T>
+struct struct_schema;
+
+template<class S, class M>
+struct field_desc {
+    const char *name;
+    M S::*member;
+};
+
+template<class S, class M>
+constexpr field_desc<S, M> field(const char *name, M S::*member) {
+    return {name, member};
+}
+
+// a column for table_handle::get_columns(): the field name of the records and the vector receiving it
+template<class T, class A = std::allocator<T>>
+struct column_desc {
+    const char *name;
+    std::vector<T, A> *out;
+};
+
+template<class T, class A>
+column_desc<T, A> column(const char *name, std::vector<T, A> &out) {
+    return {name, &out};
+}
+
+namespace stack {
+    template<class... Ts>
+    struct make_void { using type = void; };
+
+    // calls f on each element of the tuple in order
+    template<class Tuple, class F, std::size_t... I>
+    void for_each_impl(Tuple &&t, F &&f, std::index_sequence<I...>) {
+        using swallow = int[];
+        (void)swallow{0, (f(std::get<I>(t)), 0)...};
+    }
+
+    template<class Tuple, class F>
+    void for_each(Tuple &&t, F &&f) {
+        for_each_impl(std::forward<Tuple>(t), std::forward<F>(f),
+            std::make_index_sequence<std::tuple_size<std::decay_t<Tuple>>::value>{});
+    }
+
+    // converts the value at top + 1 and pops everything above top, even when throwing
+    template<class T>
+    T pop_as(lua_State *L, int top, const char *name) {
+        try {
+            auto result = value_traits<T>::get(L, top + 1, name);
+            set_top(L, top);
+            return result;
+        } catch (...) {
+            set_top(L, top);
+            throw;
+        }
+    }
+} // namespace stack
+
+// values that do not fit in T, or unsigned values above the largest lua integer, are rejected
+// instead of wrapping
+template<class T>
+struct value_traits<T, std::enable_if_t<std::is_integral<T>::value && !std::is_same<T, bool>::value>> {
+    static void push(lua_State *L, T value) {
+        if (std::is_unsigned<T>::value && static_cast<unsigned long long>(value) > static_cast<unsigned long long>(std::numeric_limits<long long>::max()))
+            throw luastate_error{"integer " + std::to_string(value) + " is out of range"};
+        stack::push_integer(L, static_cast<long long>(value));
+    }
+    static T get(lua_State *L, int idx, const char *name) {
+        auto value = stack::to_integer(L, idx, name);
+        if (!fits(value))
+            throw luastate_error{std::string{"variable/field ["} + name + "] is out of range"};
+        return static_cast<T>(value);
+    }
+
+    static bool fits(long long value) noexcept {
+        if (std::is_unsigned<T>::value)
+            return value >= 0 && static_cast<unsigned long long>(value) <= std::numeric_limits<T>::max();
+        return value >= static_cast<long long>(std::numeric_limits<T>::min())
+            && value <= static_cast<long long>(std::numeric_limits<T>::max());
+    }
+};
+
+template<class T>
+struct value_traits<T, std::enable_if_t<std::is_floating_point<T>::value>> {
+    static void push(lua_State *L, T value) {
+        stack::push_number(L, static_cast<double>(value));
+    }
+    static T get(lua_State *L, int idx, const char *name) {
+        return static_cast<T>(stack::to_number(L, idx, name));
+    }
+};
+
+template<>
+struct value_traits<bool> {
+    static void push(lua_State *L, bool value) {
+        stack::push_boolean(L, value);
+    }
+    static bool get(lua_State *L, int idx, const char *name) {
+        return stack::to_boolean(L, idx, name);
+    }
+};
+
+template<>
+struct value_traits<std::string> {
+    static void push(lua_State *L, const std::string &value) {
+        stack::push_string(L, value.data(), value.size());
+    }
+    static std::string get(lua_State *L, int idx, const char *name) {
+        auto len = std::size_t{};
+        auto str = stack::to_string(L, idx, name, len);
+        return {str, len};
+    }
+};
+
+// push only, the pointer would not outlive the lua value
+template<>
+struct value_traits<const char *> {
+    static void push(lua_State *L, const char *value) {
+        stack::push_string(L, value);
+    }
+};
+
+template<std::size_t N>
+struct value_traits<char[N]> : value_traits<const char *> {};
+
+// arrays, indexed from 1. nested containers and structs check the stack at each level
+template<class T, class A>
+struct value_traits<std::vector<T, A>> {
+    static void push(lua_State *L, const std::vector<T, A> &value) {
+        stack::reserve(L, 2);
+        stack::new_table(L, static_cast<int>(value.size()), 0);
+        auto tidx = stack::get_top(L);
+        auto i = 0LL;
+        for (const auto &elem : value) {
+            value_traits<T>::push(L, elem);
+            stack::raw_set_index(L, tidx, ++i);
+        }
+    }
+    static std::vector<T, A> get(lua_State *L, int idx, const char *name) {
+        stack::reserve(L, 1);
+        auto len = stack::table_len(L, idx, name);
+        auto result = std::vector<T, A>{};
+        result.reserve(static_cast<std::size_t>(len));
+        for (auto i = 1LL; i <= len; ++i) {
+            stack::raw_get_index(L, idx, i);
+            result.push_back(value_traits<T>::get(L, stack::get_top(L), name));
+            stack::set_top(L, stack::get_top(L) - 1);
+        }
+        return result;
+    }
+};
+
+// a host buffer exposed to lua as userdata without copying it. T is double, float, std::int64_t or
+// std::int32_t. scripts index it from 1, assign elements, get its size with # and iterate it with
+// pairs() or ipairs()
+// a borrowed view does not own the buffer, which must outlive every lua reference to it
+// an owned view frees the buffer when the last view, in C++ or in lua, is gone
+template<class T>
+class array_view {
+public:
+    using value_type = T;
+
+    static array_view borrowed(T *data, std::size_t size) noexcept {
+        return {data, size, nullptr};
+    }
+    static array_view owned(std::unique_ptr<T[]> data, std::size_t size) {
+        auto ptr = data.get();
+        return {ptr, size, std::shared_ptr<T>{data.release(), std::default_delete<T[]>{}}};
+    }
+
+    T *data() const noexcept { return ptr; }
+    std::size_t size() const noexcept { return len; }
+    T &operator[](std::size_t i) const noexcept { return ptr[i]; }
+
+private:
+    T *ptr;
+    std::size_t len;
+    // empty if borrowed
+    std::shared_ptr<T> owner;
+
+    array_view(T *data, std::size_t size, std::shared_ptr<T> own)
+        : ptr{data}, len{size}, owner{std::move(own)} {}
+
+    friend struct value_traits<array_view>;
+};
+
+namespace stack {
+    // pushes a userdata referencing the buffer, which keeps a reference to owner
+    template<class T>
+    void push_array(lua_State *L, T *data, std::size_t size, const std::shared_ptr<T> &owner);
+
+    template<class T>
+    T *to_array(lua_State *L, int idx, const char *name, std::size_t &size, std::shared_ptr<T> &owner);
+} // namespace stack
+
+template<class T>
+struct value_traits<array_view<T>> {
+    static void push(lua_State *L, const array_view<T> &value) {
+        stack::push_array(L, value.ptr, value.len, value.owner);
+    }
+    static array_view<T> get(lua_State *L, int idx, const char *name) {
+        auto size = std::size_t{};
+        auto owner = std::shared_ptr<T>{};
+        auto data = stack::to_array(L, idx, name, size, owner);
+        return {data, size, std::move(owner)};
+    }
+};
+
+// an immutable tree of values built once and exposed read-only to any number of interpreters,
+// including interpreters running on different threads
+// scalars are pushed as plain lua values. tables are pushed as proxy userdata supporting
+// indexing, # and pairs(), so every interpreter references the same data instead of a copy
+// a table has an array part (indexed from 1) and string keyed fields
+class shared_value {
+public:
+    using array_type = std::vector<shared_value>;
+    using fields_type = std::map<std::string, shared_value>;
+    // opaque
+    struct table_data;
+
+    // nil
+    shared_value() noexcept : tag{types::NIL}, i{} {}
+
+    static shared_value boolean(bool value) noexcept;
+    static shared_value integer(long long value) noexcept;
+    static shared_value number(double value) noexcept;
+    static shared_value string(std::string value);
+    static shared_value table(array_type array, fields_type fields = {});
+
+    // NIL, BOOL, INT, NUM, STR or TABLE
+    types type() const noexcept { return tag; }
+
+    // these must only be used if type() matches
+    bool as_bool() const noexcept { return b; }
+    long long as_int() const noexcept { return i; }
+    double as_num() const noexcept { return n; }
+    const std::string &as_str() const noexcept;
+
+    // table access. size() is the size of the array part, at() is indexed from 0
+    // get() returns nil if there is no such field
+    std::size_t size() const noexcept;
+    const shared_value &at(std::size_t idx) const;
+    const shared_value &get(const std::string &key) const;
+
+    // the object a string or table value refers to, used to identify tables
+    const void *identity() const noexcept { return obj.get(); }
+
+private:
+    types tag;
+    union {
+        bool b;
+        long long i;
+        double n;
+    };
+    // std::string or table_data
+    std::shared_ptr<const void> obj;
+};
+
+namespace stack {
+    void push_shared(lua_State *L, const shared_value &value);
+    // converts the lua value, tables are copied unless they are proxies of a shared_value
+    shared_value to_shared(lua_State *L, int idx, const char *name);
+} // namespace stack
+
+template<>
+struct value_traits<shared_value> {
+    static void push(lua_State *L, const shared_value &value) {
+        stack::push_shared(L, value);
+    }
+    static shared_value get(lua_State *L, int idx, const char *name) {
+        return stack::to_shared(L, idx, name);
+    }
+};
+
+// tables with any kind of keys. both the hash part and array part are filled with raw sets
+template<class Map>
+struct map_value_traits {
+    using key_type = typename Map::key_type;
+    using mapped_type = typename Map::mapped_type;
+
+    static void push(lua_State *L, const Map &value) {
+        stack::reserve(L, 3);
+        stack::new_table(L, 0, static_cast<int>(value.size()));
+        auto tidx = stack::get_top(L);
+        for (const auto &kv : value) {
+            value_traits<key_type>::push(L, kv.first);
+            value_traits<mapped_type>::push(L, kv.second);
+            stack::raw_set(L, tidx);
+        }
+    }
+    static Map get(lua_State *L, int idx, const char *name) {
+        stack::reserve(L, 3);
+        stack::check_table(L, idx, name);
+        auto result = Map{};
+        stack::push_nil(L);
+        while (stack::next(L, idx)) {
+            auto top = stack::get_top(L);
+            // convert a copy of the key, converting it in place would confuse next()
+            stack::push_copy(L, top - 1);
+            auto key = value_traits<key_type>::get(L, top + 1, name);
+            result.emplace(std::move(key), value_traits<mapped_type>::get(L, top, name));
+            // keep the key for the next iteration
+            stack::set_top(L, top - 1);
+        }
+        return result;
+    }
+};
+
+template<class K, class T, class H, class E, class A>
+struct value_traits<std::unordered_map<K, T, H, E, A>> : map_value_traits<std::unordered_map<K, T, H, E, A>> {};
+
+template<class K, class T, class C, class A>
+struct value_traits<std::map<K, T, C, A>> : map_value_traits<std::map<K, T, C, A>> {};
+
+// the type tag of ptr<T>, from 1 to 32767, e.g.
+//     namespace luai {
+//     template<> struct ptr_tag<session> { static constexpr std::uint16_t value = 1; };
+//     }
+// tags are fixed at compile time, so every module agrees on them. a ptr<const T> is pushed with
+// the const bit set, so it can be read back as ptr<const T> but not as ptr<T>
+template<class T>
+struct ptr_tag;
+
+// a host pointer passed to lua, tagged with the ptr_tag of its type. reading it back as another
+// ptr type, or from any other value, fails like any type mismatch. the pointed object is not owned
+// the tag is kept in the top 16 bits of a light userdata, so nothing is allocated when these bits
+// are zero, as for user space pointers on x86-64 and aarch64 with 48-bit addresses. other pointers
+// are boxed in a full userdata: tagged heap pointers (aarch64 MTE or HWASan, android), and
+// addresses above 2^48 (x86-64 with 5-level paging). a light userdata pushed by other code can be
+// mistaken for a ptr only if its top 16 bits match a tag. boxed pointers compare unequal in lua
+template<class T>
+class ptr {
+public:
+    ptr() noexcept = default;
+    ptr(T *p) noexcept : p{p} {}
+
+    T *get() const noexcept { return p; }
+    T &operator*() const noexcept { return *p; }
+    T *operator->() const noexcept { return p; }
+    explicit operator bool() const noexcept { return p != nullptr; }
+
+private:
+    T *p = nullptr;
+};
+
+namespace stack {
+    // set in the tag of pointers to const
+    constexpr std::uint16_t const_tag = 0x8000;
+
+    // boxes the pointer when its top 16 bits are in use
+    void push_tagged(lua_State *L, const void *ptr, std::uint16_t tag);
+    // also accepts tag | const_tag when to_const
+    void *to_tagged(lua_State *L, int idx, std::uint16_t tag, bool to_const, const char *name);
+} // namespace stack
+
+template<class T>
+struct value_traits<ptr<T>> {
+    static_assert(sizeof(void *) == 8, "ptr<T> needs 64-bit pointers");
+    static constexpr std::uint16_t tag = ptr_tag<std::remove_cv_t<T>>::value;
+    static_assert(tag != 0 && tag < stack::const_tag, "ptr tags go from 1 to 32767");
+
+    static void push(lua_State *L, ptr<T> value) {
+        stack::push_tagged(L, value.get(), std::is_const<T>::value ? tag | stack::const_tag : tag);
+    }
+    static ptr<T> get(lua_State *L, int idx, const char *name) {
+        return static_cast<T *>(stack::to_tagged(L, idx, tag, std::is_const<T>::value, name));
+    }
+};
+
+// structs described by struct_schema
+template<class T>
+struct value_traits<T, typename stack::make_void<decltype(struct_schema<T>::fields())>::type> {
+    static void push(lua_State *L, const T &value) {
+        auto fields = struct_schema<T>::fields();
+        stack::reserve(L, 2);
+        stack::new_table(L, 0, static_cast<int>(std::tuple_size<decltype(fields)>::value));
+        auto tidx = stack::get_top(L);
+        stack::for_each(fields, [&](const auto &f) {
+            value_traits<std::decay_t<decltype(value.*f.member)>>::push(L, value.*f.member);
+            stack::set_field(L, tidx, f.name);
+        });
+    }
+    static T get(lua_State *L, int idx, const char *name) {
+        stack::reserve(L, 2);
+        stack::check_table(L, idx, name);
+        auto result = T{};
+        stack::for_each(struct_schema<T>::fields(), [&](const auto &f) {
+            stack::raw_get_field(L, idx, f.name);
+            result.*f.member = value_traits<std::decay_t<decltype(result.*f.member)>>::get(
+                L, stack::get_top(L), f.name);
+            stack::set_top(L, stack::get_top(L) - 1);
+        });
+        return result;
+    }
+};
+
+namespace stack {
+    using c_function = int (*)(lua_State *L);
+
+    // pushes f as a closure, with a copy of the size bytes at data as a userdata upvalue
+    // pop 0, push 1
+    void push_closure(lua_State *L, c_function f, const void *data, std::size_t size);
+    // the userdata upvalue of the running closure
+    void *closure_data(lua_State *L) noexcept;
+    // raises the error message on the top of the stack, does not return
+    int raise_error(lua_State *L);
+    // "argument #n" for the argument at index n (from 1), used in error messages
+    const char *arg_name(int n) noexcept;
+
+    // continuation of a C function that yielded, with the ctx it yielded with (lua_KContext)
+    using k_context = std::intptr_t;
+    using k_function = int (*)(lua_State *L, int status, k_context ctx);
+
+    // yields the nresults values on the top from a C function, which must return it at once
+    // k is called with ctx when the thread is resumed, with the stack below the values kept
+    int yield(lua_State *L, int nresults, k_context ctx, k_function k);
+    bool is_yieldable(lua_State *L) noexcept;
+    // pop 0, push 1
+    void push_light(lua_State *L, const void *p);
+    // the light userdata at idx, or nullptr if it is not one
+    void *to_light(lua_State *L, int idx) noexcept;
+
+    // runs f, which may throw. a std::exception becomes an error message on the top of the stack
+    // and false is returned: the caller raises it with lua_error() once no C++ object is in scope
+    // other exceptions pass through, as lua built as C++ raises its errors with them. f must not raise
+    // lua errors, which would skip C++ destructors when lua is built as C: values are read with raw
+    // access, so that no metamethod runs. lua only raises memory errors there
+    template<class F>
+    bool catch_to_message(lua_State *L, F &&f) {
+        auto top = get_top(L);
+        try {
+            f();
+            return true;
+        } catch (const std::exception &e) {
+            set_top(L, top);
+            push_string(L, e.what());
+        }
+        return false;
+    }
+
+    // a lua_CFunction calling the function pointer kept in its upvalue. arguments are converted and
+    // results pushed with value_traits, a std::tuple is pushed as several results
+    // a std::exception becomes a lua error, raised once no C++ object is in scope
+    template<class R, class... Args>
+    struct trampoline {
+        using pointer = R (*)(Args...);
+
+        static int call(lua_State *L) {
+            auto nresults = run(L);
+            return nresults >= 0 ? nresults : raise_error(L);
+        }
+
+        // returns the number of results, or -1 with the error message pushed
+        static int run(lua_State *L) {
+            auto nresults = -1;
+            catch_to_message(L, [L, &nresults] {
+                auto fn = *static_cast<pointer *>(closure_data(L));
+                nresults = apply(L, fn, std::index_sequence_for<Args...>{}, std::is_void<R>{});
+            });
+            return nresults;
+        }
+
+        template<std::size_t... I>
+        static int apply(lua_State *L, pointer fn, std::index_sequence<I...>, std::true_type) {
+            // unused when there is no argument
+            (void)L;
+            fn(value_traits<std::decay_t<Args>>::get(L, static_cast<int>(I) + 1, arg_name(static_cast<int>(I) + 1))...);
+            return 0;
+        }
+
+        template<std::size_t... I>
+        static int apply(lua_State *L, pointer fn, std::index_sequence<I...>, std::false_type) {
+            return push_results(L,
+                fn(value_traits<std::decay_t<Args>>::get(L, static_cast<int>(I) + 1, arg_name(static_cast<int>(I) + 1))...));
+        }
+
+        template<class T>
+        static int push_results(lua_State *L, const T &value) {
+            value_traits<T>::push(L, value);
+            return 1;
+        }
+
+        template<class... Ts>
+        static int push_results(lua_State *L, const std::tuple<Ts...> &values) {
+            reserve(L, static_cast<int>(sizeof...(Ts)));
+            for_each(values, [L](const auto &value) {
+                value_traits<std::decay_t<decltype(value)>>::push(L, value);
+            });
+            return static_cast<int>(sizeof...(Ts));
+        }
+    };
+
+    // the function pointer type and trampoline of a function pointer, or of a lambda's call operator
+    template<class F>
+    struct function_traits : function_traits<decltype(&F::operator())> {};
+
+    template<class R, class... Args>
+    struct function_traits<R (*)(Args...)> {
+        using pointer = R (*)(Args...);
+        using trampoline_type = trampoline<R, Args...>;
+    };
+
+    template<class C, class R, class... Args>
+    struct function_traits<R (C::*)(Args...) const> : function_traits<R (*)(Args...)> {};
+} // namespace stack
+
+namespace stack {
+    // lua 5.3 only aligns userdata blocks like its L_Umaxalign (a double, a pointer or an integer):
+    // the header in front of the block is not padded to the alignment of malloc
+    constexpr std::size_t userdata_alignment = 8;
+
+    // the address of key identifies the metatable of a bound class T in the registry
+    template<class T>
+    struct class_key {
+        static const char key;
+    };
+
+    template<class T>
+    const char class_key<T>::key = 0;
+
+    // property accessors of bound classes, called by __index and __newindex with the object and the
+    // member pointer. they return false with the error message pushed instead of throwing
+    using property_get = bool (*)(lua_State *L, void *obj, const void *member);
+    using property_set = bool (*)(lua_State *L, void *obj, const void *member, int idx);
+
+    // creates the metatable of a bound class, replacing a previous one. gc destroys an object
+    void new_class(lua_State *L, const void *key, const char *name, c_function gc);
+    bool has_class(lua_State *L, const void *key);
+    // adds a method closure with a copy of the size bytes at data as upvalue 1, and the metatable as upvalue 2
+    void add_method(lua_State *L, const void *key, const char *name, c_function f, const void *data,
+        std::size_t size);
+    // set is NULL for read-only properties
+    void add_property(lua_State *L, const void *key, const char *name, property_get get, property_set set,
+        const void *member, std::size_t size);
+    // sets <class name>.new to f, a closure with the metatable as upvalue 1
+    void add_constructor(lua_State *L, const void *key, c_function f);
+
+    // pushes the metatable and an object to construct in place, throws if the class is not registered
+    // pop 0, push 2
+    void *new_object(lua_State *L, const void *key, std::size_t size);
+    // same, with the metatable in upvalue 1 of a constructor
+    void *construct_object(lua_State *L, std::size_t size);
+    // sets the metatable of the object once it is constructed
+    // pop 2, push 1
+    void finish_object(lua_State *L);
+    void *to_object(lua_State *L, int idx, const void *key, const char *name);
+    // the object at index 1 of a method, checked against the metatable in upvalue 2
+    void *method_self(lua_State *L);
+    void *userdata_at(lua_State *L, int idx) noexcept;
+
+    template<class T>
+    int destroy_object(lua_State *L) {
+        static_cast<T *>(userdata_at(L, 1))->~T();
+        return 0;
+    }
+
+    template<class T, class... Args>
+    struct constructor_trampoline {
+        static int call(lua_State *L) {
+            return run(L) ? 1 : raise_error(L);
+        }
+
+        static bool run(lua_State *L) {
+            return catch_to_message(L, [L] { construct(L, std::index_sequence_for<Args...>{}); });
+        }
+
+        template<std::size_t... I>
+        static void construct(lua_State *L, std::index_sequence<I...>) {
+            // the arguments are at fixed indices, whether they are converted before or after the block
+            new (construct_object(L, sizeof(T)))
+                T(value_traits<std::decay_t<Args>>::get(L, static_cast<int>(I) + 1, arg_name(static_cast<int>(I) + 1))...);
+            finish_object(L);
+        }
+    };
+
+    // like trampoline, the member function pointer being in upvalue 1, the object at index 1
+    template<class T, class Pointer, class R, class... Args>
+    struct method_trampoline {
+        static int call(lua_State *L) {
+            auto nresults = run(L);
+            return nresults >= 0 ? nresults : raise_error(L);
+        }
+
+        static int run(lua_State *L) {
+            auto nresults = -1;
+            catch_to_message(L, [L, &nresults] {
+                auto self = static_cast<T *>(method_self(L));
+                auto fn = *static_cast<Pointer *>(closure_data(L));
+                nresults = apply(L, self, fn, std::index_sequence_for<Args...>{}, std::is_void<R>{});
+            });
+            return nresults;
+        }
+
+        template<std::size_t... I>
+        static int apply(lua_State *L, T *self, Pointer fn, std::index_sequence<I...>, std::true_type) {
+            (self->*fn)(value_traits<std::decay_t<Args>>::get(L, static_cast<int>(I) + 2, arg_name(static_cast<int>(I) + 2))...);
+            return 0;
+        }
+
+        template<std::size_t... I>
+        static int apply(lua_State *L, T *self, Pointer fn, std::index_sequence<I...>, std::false_type) {
+            return trampoline<R, Args...>::push_results(L,
+                (self->*fn)(value_traits<std::decay_t<Args>>::get(L, static_cast<int>(I) + 2, arg_name(static_cast<int>(I) + 2))...));
+        }
+    };
+
+    template<class T, class Pointer>
+    struct method_traits;
+
+    template<class T, class C, class R, class... Args>
+    struct method_traits<T, R (C::*)(Args...)> {
+        using trampoline_type = method_trampoline<T, R (C::*)(Args...), R, Args...>;
+    };
+
+    template<class T, class C, class R, class... Args>
+    struct method_traits<T, R (C::*)(Args...) const> {
+        using trampoline_type = method_trampoline<T, R (C::*)(Args...) const, R, Args...>;
+    };
+
+    template<class T, class M>
+    struct property_access {
+        using pointer = M T::*;
+
+        static bool get(lua_State *L, void *obj, const void *member) {
+            return catch_to_message(L, [=] {
+                value_traits<M>::push(L, static_cast<T *>(obj)->*(*static_cast<const pointer *>(member)));
+            });
+        }
+
+        static bool set(lua_State *L, void *obj, const void *member, int idx) {
+            return catch_to_message(L, [=] {
+                static_cast<T *>(obj)->*(*static_cast<const pointer *>(member)) = value_traits<M>::get(L, idx, "property");
+            });
+        }
+    };
+} // namespace stack
+
+// describes a class bound with lua_interpreter::register_class(). objects are placed in their
+// userdata block and destroyed when collected. methods are closures keeping the member function
+// pointer and the metatable as upvalues
+template<class T>
+class class_binding {
+public:
+    // lets scripts create objects with <class name>.new(args...)
+    template<class... Args>
+    class_binding &constructor() {
+        stack::add_constructor(L, &stack::class_key<T>::key, &stack::constructor_trampoline<T, Args...>::call);
+        return *this;
+    }
+
+    // obj:name(args...) calls the member function, converting arguments and results with value_traits
+    template<class Pointer>
+    class_binding &method(const char *name, Pointer fn) {
+        static_assert(std::is_member_function_pointer<Pointer>::value, "method() needs a member function");
+        stack::add_method(L, &stack::class_key<T>::key, name, &stack::method_traits<T, Pointer>::trampoline_type::call,
+            &fn, sizeof fn);
+        return *this;
+    }
+
+    // obj.name reads the data member, and obj.name = value assigns it
+    template<class M, class C>
+    class_binding &property(const char *name, M C::*member) {
+        return add_property(name, member, &stack::property_access<T, M>::set);
+    }
+
+    // obj.name reads the data member, assigning it is an error
+    template<class M, class C>
+    class_binding &readonly(const char *name, M C::*member) {
+        return add_property(name, member, nullptr);
+    }
+
+private:
+    lua_State *L;
+
+    explicit class_binding(lua_State *state) noexcept : L{state} {}
+
+    template<class M, class C>
+    class_binding &add_property(const char *name, M C::*member, stack::property_set set) {
+        static_assert(!std::is_function<M>::value, "use method() for member functions");
+        M T::*ptr = member;
+        stack::add_property(L, &stack::class_key<T>::key, name, &stack::property_access<T, M>::get, set,
+            &ptr, sizeof ptr);
+        return *this;
+    }
+
+    friend class lua_interpreter;
+};
+
 class lua_interpreter {
 public:
 
@@ -47,6 +900,15 @@ public:
     // returns whether executing waas successful PLUS error message
     std::tuple<bool, std::string> run_chunk(const char *code) noexcept;
 
+    // makes protected calls (run_chunk(), call() and function_ref) and coroutines record up to
+    // max_frames stack frames when an error is raised, 0 (the default) turns it off. recording only copies the frames,
+    // the traceback string is built when traceback() is called
+    void set_traceback(std::size_t max_frames);
+
+    // the traceback of the last error recorded, formatted like debug.traceback(), or "" if none.
+    // every protected call clears it, so it is the trace of the last call if that one failed
+    std::string traceback() const;
+
     // opens all standard libraries
     void openlibs() noexcept;
 
@@ -54,13 +916,449 @@ public:
     template<types Type>
     get_var_t<Type> get_global(const char *varname);
 
+    // creates an empty table, preallocating narr array elements and nrec other fields
+    table_handle new_table(int narr = 0, int nrec = 0);
+
+    // same as new_table(), but returns a builder for filling the table
+    table_builder build_table(int narr, int nrec = 0);
+
+    // registers a field name for get_field(const key_token &). the name is kept alive in the
+    // registry as long as the token, so do this once per name
+    key_token make_key(const char *name);
+
+    // registers the msgpack module, with msgpack.pack(value) returning a string and
+    // msgpack.unpack(string) returning the value. it is also set as a global
+    void open_msgpack() noexcept;
+
+    // appends a global variable to buf in the MessagePack format. tables are packed with raw access,
+    // as arrays if their keys are 1..#t, and as maps otherwise. functions, userdata and cyclic tables
+    // cannot be packed. on error buf is left unchanged
+    void pack_global(const char *varname, std::string &buf);
+
+    // sets a global variable to the value packed in data
+    void unpack_global(const char *varname, const char *data, std::size_t len);
+
+    // registers the json module, with json.encode(value) returning a string, json.decode(string)
+    // returning the value, and json.null standing for null. it is also set as a global
+    void open_json() noexcept;
+
+    // creates a table from JSON text holding an object or an array. null becomes json.null,
+    // the NULL light userdata
+    table_handle from_json(const char *text, std::size_t len);
+
+    // like get_global(), but returns the error instead of throwing luastate_error
+    template<types Type>
+    get_result<Type> try_get_global(const char *varname);
+
+    // set a global variable, e.g. set_global<types::INT>("x", 5)
+    template<types Type>
+    void set_global(const char *varname, set_var_t<Type> value);
+
+    // get a global variable as any C++ type with value_traits, e.g. a struct with a struct_schema
+    template<class T>
+    T get_global(const char *varname) {
+        auto L = lua_state();
+        auto top = stack::get_top(L);
+        stack::get_global(L, varname);
+        return stack::pop_as<T>(L, top, varname);
+    }
+
+    // set a global variable from any C++ type with value_traits
+    template<class T>
+    void set_global(const char *varname, const T &value) {
+        auto L = lua_state();
+        value_traits<T>::push(L, value);
+        stack::set_global(L, varname);
+    }
+
+    // calls a global function in protected mode, e.g. call<types::INT, types::STR>("f", 1, "x")
+    // returns std::tuple<long long, std::string>. arguments are pushed with value_traits, table
+    // handles pass their table. only value types can be returned
+    // throws luastate_error with the lua error message if the call fails
+    template<types... Rets, class... Args>
+    std::tuple<get_var_t<Rets>...> call(const char *fname, const Args &... args) {
+        static_assert(std::is_same<std::integer_sequence<bool, true, is_call_result(Rets)...>,
+                                   std::integer_sequence<bool, is_call_result(Rets)..., true>>::value,
+            "call() only returns INT, NUM, STR or BOOL");
+        auto L = lua_state();
+        auto top = stack::get_top(L);
+        stack::reserve(L, static_cast<int>(sizeof...(Args) + sizeof...(Rets)) + 1);
+        stack::get_global(L, fname);
+        return invoke<Rets...>(L, top, fname, args...);
+    }
+
+    // references a global function, for calling it many times without looking it up
+    function_ref get_function(const char *varname);
+
+    // creates a coroutine running a global function, or a referenced one. its lua thread is taken
+    // from the pool of the interpreter when there is one
+    coroutine new_coroutine(const char *fname);
+    coroutine new_coroutine(const function_ref &f);
+
+    // binds a C++ class, creating its metatable, e.g.
+    // register_class<counter>("counter").constructor<long long>().method("add", &counter::add)
+    //     .property("value", &counter::value)
+    // registering a class again replaces the binding for new objects
+    template<class T>
+    class_binding<T> register_class(const char *name) {
+        static_assert(alignof(T) <= stack::userdata_alignment, "classes aligned to more than 8 bytes cannot be bound");
+        auto L = lua_state();
+        stack::new_class(L, &stack::class_key<T>::key, name, &stack::destroy_object<T>);
+        return class_binding<T>{L};
+    }
+
+    // whether register_class<T>() was called
+    template<class T>
+    bool has_class() const {
+        return stack::has_class(lua_state(), &stack::class_key<T>::key);
+    }
+
+    // constructs an object of a bound class in a global variable. the reference stays valid as long
+    // as lua references the object
+    template<class T, class... Args>
+    T &new_object(const char *varname, Args &&... args) {
+        auto L = lua_state();
+        auto top = stack::get_top(L);
+        try {
+            auto obj = new (stack::new_object(L, &stack::class_key<T>::key, sizeof(T))) T(std::forward<Args>(args)...);
+            stack::finish_object(L);
+            stack::set_global(L, varname);
+            return *obj;
+        } catch (...) {
+            stack::set_top(L, top);
+            throw;
+        }
+    }
+
+    // the object of a bound class in a global variable, valid as long as lua references it
+    template<class T>
+    T &get_object(const char *varname) {
+        auto L = lua_state();
+        auto top = stack::get_top(L);
+        stack::get_global(L, varname);
+        try {
+            auto obj = static_cast<T *>(stack::to_object(L, top + 1, &stack::class_key<T>::key, varname));
+            stack::set_top(L, top);
+            return *obj;
+        } catch (...) {
+            stack::set_top(L, top);
+            throw;
+        }
+    }
+
+    // registers a raw lua_CFunction as it is
+    void register_function(const char *varname, stack::c_function fn);
+    // same, as a closure with a copy of the size bytes at data, read with stack::closure_data()
+    void register_function(const char *varname, stack::c_function fn, const void *data, std::size_t size);
+
+    // exposes a C++ function, or a lambda without captures, as a global lua function
+    // e.g. register_function("clamp", [](double x, double lo, double hi) { return std::min(std::max(x, lo), hi); })
+    // arguments and results are converted with value_traits, a std::tuple returns several results.
+    // wrong arguments and std::exceptions become lua errors. nothing is allocated per call
+    template<class F>
+    void register_function(const char *varname, F fn) {
+        using traits = stack::function_traits<std::decay_t<F>>;
+        using pointer = typename traits::pointer;
+        static_assert(std::is_convertible<F, pointer>::value,
+            "only functions and lambdas without captures can be registered");
+        auto L = lua_state();
+        auto ptr = static_cast<pointer>(fn);
+        stack::push_closure(L, &traits::trampoline_type::call, &ptr, sizeof ptr);
+        stack::set_global(L, varname);
+    }
+
 private:
     struct impl;
     std::shared_ptr<impl> pimpl;
 
+    lua_State *lua_state() const noexcept;
+
+    // the function is at top + 1: pushes the arguments, calls it and converts the results
+    // restores the top, even when throwing. the stack must have room for the arguments and results
+    template<types... Rets, class... Args>
+    static std::tuple<get_var_t<Rets>...> invoke(lua_State *L, int top, const char *name, const Args &... args) {
+        try {
+            stack::for_each(std::forward_as_tuple(args...), [L](const auto &arg) {
+                value_traits<std::decay_t<decltype(arg)>>::push(L, arg);
+            });
+            stack::call(L, static_cast<int>(sizeof...(Args)), static_cast<int>(sizeof...(Rets)));
+            auto result = call_results<Rets...>(L, top + 1, name, std::index_sequence_for<get_var_t<Rets>...>{});
+            stack::set_top(L, top);
+            return result;
+        } catch (...) {
+            stack::set_top(L, top);
+            throw;
+        }
+    }
+
+    // converts the results of call() starting at base, braced initialization keeps them in order
+    template<types... Rets, std::size_t... I>
+    static std::tuple<get_var_t<Rets>...> call_results(lua_State *L, int base, const char *fname,
+            std::index_sequence<I...>) {
+        // unused when there is no result
+        (void)L;
+        (void)fname;
+        return std::tuple<get_var_t<Rets>...>{
+            value_traits<get_var_t<Rets>>::get(L, base + static_cast<int>(I), fname)...};
+    }
+
+    friend class table_handle;
+    friend class string_handle;
+    friend class function_ref;
+    friend class key_token;
+    friend class coroutine;
+    friend class scheduler;
+    friend void copy_value(lua_interpreter &, const char *, lua_interpreter &, const char *);
+};
+
+// copies a value from one interpreter into a global variable of another, without going through text.
+// path is a global name, or fields below it separated by dots, e.g. "config.db". tables referenced
+// more than once are copied once, so shared references and cycles are kept. tables are read with raw
+// access and created with their final size. metatables are not copied, functions and userdata cannot
+// be copied, except shared_value proxies and light userdata
+void copy_value(lua_interpreter &src, const char *path, lua_interpreter &dst, const char *name);
+
+// a row of function_ref::call_batch() that failed
+struct batch_error {
+    std::size_t row;
+    std::string message;
+};
+
+namespace stack {
+    // the rows of a batch call. push_row pushes the nargs arguments of a row, store_row converts
+    // the result of a row at idx. both are called from inside lua and must not throw
+    struct batch {
+        std::size_t rows;
+        std::size_t next;
+        int nargs;
+        void *context;
+        void (*push_row)(void *context, lua_State *L, std::size_t row);
+        void (*store_row)(void *context, lua_State *L, std::size_t row, int idx);
+        std::vector<batch_error> *errors;
+    };
+
+    // calls the function on the top for each row, all inside one protected call. a row raising an
+    // error is added to b.errors, and the remaining rows run in a new protected call
+    // pop 0, push 0
+    void call_batch(lua_State *L, batch &b);
+} // namespace stack
+
+// a lua function referenced from the registry, so calling it needs no lookup by name
+// it keeps the interpreter alive, and releases the reference when destroyed
+// a field name registered once with lua_interpreter::make_key(). looking fields up with it
+// skips hashing and interning the name on every call
+// it can only be used with tables of the interpreter that made it, which it keeps alive like a
+// function_ref. the name is released from the registry when the token is destroyed
+class key_token {
+public:
+    const std::string &name() const noexcept { return key_name; }
+    int ref() const noexcept { return key_ref; }
+    // the interpreter that made it, which cannot be freed before the token
+    const void *owner() const noexcept { return pstate.get(); }
+
+    // MOVE
+    key_token(key_token &&) noexcept;
+    key_token &operator=(key_token &&) noexcept;
+
+    // COPYING DELETED
+
+    ~key_token();
+
+private:
+    std::shared_ptr<lua_interpreter::impl> pstate;
+    int key_ref;
+    std::string key_name;
+
+    key_token(std::shared_ptr<lua_interpreter::impl>, int, std::string);
+    void release() noexcept;
+
+    friend class lua_interpreter;
+};
+
+class function_ref {
+public:
+    // same as lua_interpreter::call(), e.g. call<types::INT>(1, "x")
+    template<types... Rets, class... Args>
+    std::tuple<get_var_t<Rets>...> call(const Args &... args) {
+        static_assert(std::is_same<std::integer_sequence<bool, true, is_call_result(Rets)...>,
+                                   std::integer_sequence<bool, is_call_result(Rets)..., true>>::value,
+            "call() only returns INT, NUM, STR or BOOL");
+        if (!L)
+            throw luastate_error{"call through an empty function_ref"};
+        auto top = stack::get_top(L);
+        // one check for all the arguments and results
+        stack::reserve(L, static_cast<int>(sizeof...(Args) + sizeof...(Rets)) + 1);
+        stack::push_ref(L, ref);
+        return lua_interpreter::invoke<Rets...>(L, top, "function", args...);
+    }
+
+    // calls the function once per row, row i passing element i of every column, e.g.
+    // call_batch(scores, errors, ids, names). columns are std::vectors or array_views of numbers,
+    // bools or strings of the same size. out is resized to the number of rows and gets the first
+    // result of every row. a row raising an error, or returning a result that cannot be converted,
+    // is added to errors and leaves its output value-initialized. returns the number of failed rows
+    template<class Out, class... Cols>
+    std::size_t call_batch(std::vector<Out> &out, std::vector<batch_error> &errors, const Cols &... cols) {
+        static_assert(sizeof...(Cols) > 0, "call_batch() needs at least one column");
+        if (!L)
+            throw luastate_error{"call through an empty function_ref"};
+        const std::size_t sizes[] = {cols.size()...};
+        for (auto size : sizes) {
+            if (size != sizes[0])
+                throw luastate_error{"call_batch() columns differ in size"};
+        }
+        out.assign(sizes[0], Out{});
+        auto failed = errors.size();
+        auto columns = std::forward_as_tuple(cols...);
+        auto rows = batch_rows<Out, decltype(columns)>{columns, out, errors};
+        auto b = stack::batch{sizes[0], 0, static_cast<int>(sizeof...(Cols)), &rows,
+            &batch_rows<Out, decltype(columns)>::push_row, &batch_rows<Out, decltype(columns)>::store_row, &errors};
+        auto top = stack::get_top(L);
+        stack::reserve(L, 4);
+        stack::push_ref(L, ref);
+        try {
+            stack::call_batch(L, b);
+        } catch (...) {
+            stack::set_top(L, top);
+            throw;
+        }
+        stack::set_top(L, top);
+        return errors.size() - failed;
+    }
+
+    explicit operator bool() const noexcept { return L != nullptr; }
+
+    // MOVE
+    function_ref(function_ref &&) noexcept;
+    function_ref &operator=(function_ref &&) noexcept;
+
+    // COPYING DELETED
+
+    ~function_ref();
+
+private:
+    std::shared_ptr<lua_interpreter::impl> pstate;
+    lua_State *L;
+    int ref;
+
+    // pops the function on the top of the stack into the registry
+    function_ref(std::shared_ptr<lua_interpreter::impl>);
+    void release() noexcept;
+
+    // the columns and outputs of call_batch(), for stack::batch
+    template<class Out, class Columns>
+    struct batch_rows {
+        Columns &columns;
+        std::vector<Out> &out;
+        std::vector<batch_error> &errors;
+
+        // value_traits push numbers, bools and strings without throwing
+        static void push_row(void *context, lua_State *L, std::size_t row) {
+            auto self = static_cast<batch_rows *>(context);
+            stack::for_each(self->columns, [L, row](const auto &col) {
+                using value_type = typename std::decay_t<decltype(col)>::value_type;
+                static_assert(std::is_arithmetic<value_type>::value || std::is_same<value_type, std::string>::value,
+                    "call_batch() columns hold numbers, bools or strings");
+                value_traits<value_type>::push(L, col[row]);
+            });
+        }
+
+        static void store_row(void *context, lua_State *L, std::size_t row, int idx) {
+            auto self = static_cast<batch_rows *>(context);
+            try {
+                self->out[row] = value_traits<Out>::get(L, idx, "result");
+            } catch (const std::exception &e) {
+                self->errors.push_back({row, e.what()});
+            }
+        }
+    };
+
+    friend class lua_interpreter;
     friend class table_handle;
 };
 
+// status of a coroutine
+enum class co_status {
+    SUSPENDED, // not started yet, or yielded: resume() continues it
+    DONE,      // the function returned
+    ERROR      // the function raised an error, error() tells which
+};
+
+// a lua function running in its own lua thread, resumed from C++. the threads come from a pool of
+// the interpreter: destroying a coroutine that is done or was never resumed gives its thread back, so
+// in steady state starting a coroutine allocates nothing. lua 5.3 cannot reset a thread that yielded
+// or failed, those are released to the garbage collector instead
+class coroutine {
+public:
+    // starts the function with args, or continues it with args as the results of coroutine.yield()
+    // the values it yields or returns are read with get()
+    // throws luastate_error if the coroutine is not suspended or an argument cannot be pushed
+    template<class... Args>
+    co_status resume(const Args &... args) {
+        if (!co || st != co_status::SUSPENDED)
+            throw luastate_error{"cannot resume a coroutine that is not suspended"};
+        auto top = stack::get_top(L);
+        stack::reserve(L, static_cast<int>(sizeof...(Args)));
+        try {
+            stack::for_each(std::forward_as_tuple(args...), [this](const auto &arg) {
+                value_traits<std::decay_t<decltype(arg)>>::push(L, arg);
+            });
+        } catch (...) {
+            stack::set_top(L, top);
+            throw;
+        }
+        return resume_with(static_cast<int>(sizeof...(Args)));
+    }
+
+    co_status status() const noexcept { return st; }
+
+    // the number of values yielded or returned by the last resume()
+    int size() const noexcept { return nvalues; }
+
+    // value n, from 1, of the values yielded or returned by the last resume(), e.g. get<long long>(1)
+    template<class T>
+    T get(int n) const {
+        if (n < 1 || n > nvalues)
+            throw luastate_error{"coroutine value #" + std::to_string(n) + " does not exist"};
+        return value_traits<T>::get(co, n, "coroutine value");
+    }
+
+    // the error message if status() is ERROR, "" otherwise
+    std::string error() const;
+
+    // the lua thread, where the values of the last resume() are from index 1
+    lua_State *thread() const noexcept { return co; }
+
+    explicit operator bool() const noexcept { return co != nullptr; }
+
+    // an empty coroutine, assigning another one gives its thread back
+    coroutine() noexcept : L{nullptr}, co{nullptr}, ref{0}, st{co_status::DONE}, nvalues{0} {}
+
+    // MOVE
+    coroutine(coroutine &&) noexcept;
+    coroutine &operator=(coroutine &&) noexcept;
+
+    // COPYING DELETED
+
+    ~coroutine();
+
+private:
+    std::shared_ptr<lua_interpreter::impl> pstate;
+    lua_State *L;
+    lua_State *co;
+    int ref;
+    co_status st;
+    int nvalues;
+
+    // takes a thread from the pool and moves the function on the top of the stack to it
+    explicit coroutine(std::shared_ptr<lua_interpreter::impl>);
+    // moves nargs arguments from the top of the main stack to the thread and resumes it
+    co_status resume_with(int nargs);
+    void release() noexcept;
+
+    friend class lua_interpreter;
+};
+
 // RAII managed lua table getter
 // when this object is alive, the top of the lua stack is always the table.
 // when this object is destroyed, the top of the stack is popped
@@ -74,10 +1372,153 @@ public:
     template<types Type>
     get_var_t<Type> get_index(long long idx);
 
+    // get a field using a key registered with lua_interpreter::make_key()
+    template<types Type>
+    get_var_t<Type> get_field(const key_token &key);
+
+    // like get_field() and get_index(), but return the error instead of throwing luastate_error
+    template<types Type>
+    get_result<Type> try_get_field(const char *varname);
+
+    template<types Type>
+    get_result<Type> try_get_field(const key_token &key);
+
+    template<types Type>
+    get_result<Type> try_get_index(long long idx);
+
+    // set a field of the current table, e.g. set_field<types::STR>("name", "lua")
+    template<types Type>
+    void set_field(const char *varname, set_var_t<Type> value);
+
+    template<types Type>
+    void set_field(const key_token &key, set_var_t<Type> value);
+
+    // set a field using int index of the current array
+    template<types Type>
+    void set_index(long long idx, set_var_t<Type> value);
+
+    // same as get_field() and get_index(), but converts to any C++ type with value_traits
+    template<class T>
+    T get_field(const char *varname) {
+        auto L = checked_state();
+        auto top = stack::get_top(L);
+        stack::get_field(L, stack_index(), varname);
+        return stack::pop_as<T>(L, top, varname);
+    }
+
+    template<class T>
+    T get_index(long long idx) {
+        auto L = checked_state();
+        auto top = stack::get_top(L);
+        stack::get_index(L, stack_index(), idx);
+        return stack::pop_as<T>(L, top, "array element");
+    }
+
+    // converts the current table as a whole, e.g. to a struct with a struct_schema
+    template<class T>
+    T decode() {
+        auto L = checked_state();
+        auto top = stack::get_top(L);
+        try {
+            return value_traits<T>::get(L, stack_index(), "table");
+        } catch (...) {
+            stack::set_top(L, top);
+            throw;
+        }
+    }
+
+    // set a field of the current table, or an element of the current array, from any C++ type
+    // with value_traits
+    template<class T>
+    void set_field(const char *varname, const T &value) {
+        auto L = checked_state();
+        value_traits<T>::push(L, value);
+        stack::set_field(L, stack_index(), varname);
+    }
+
+    template<class T>
+    void set_index(long long idx, const T &value) {
+        auto L = checked_state();
+        value_traits<T>::push(L, value);
+        stack::set_index(L, stack_index(), idx);
+    }
+
+    // the current table is an array of records. copies the given field of every record into one
+    // vector per column, e.g. get_columns(column("id", ids), column("score", scores))
+    // the vectors are cleared first. every record must have every field. returns the number of records
+    template<class... Cols>
+    long long get_columns(Cols... cols) {
+        auto L = checked_state();
+        auto tidx = stack_index();
+        auto top = stack::get_top(L);
+        auto len = stack::table_len(L, tidx, "records");
+        auto columns = std::make_tuple(cols...);
+        constexpr auto ncols = static_cast<int>(sizeof...(Cols));
+        stack::reserve(L, ncols + 3);
+        // the keys are pushed once, so they need not be hashed for every record
+        stack::for_each(columns, [&](const auto &col) {
+            stack::push_string(L, col.name);
+            col.out->clear();
+            col.out->reserve(static_cast<std::size_t>(len));
+        });
+        try {
+            for (auto i = 1LL; i <= len; ++i) {
+                stack::raw_get_index(L, tidx, i);
+                auto ridx = top + ncols + 1;
+                stack::check_table(L, ridx, "record");
+                auto keyidx = top;
+                stack::for_each(columns, [&](const auto &col) {
+                    using value_type = typename std::decay_t<decltype(*col.out)>::value_type;
+                    stack::push_copy(L, ++keyidx);
+                    stack::raw_get(L, ridx);
+                    col.out->push_back(value_traits<value_type>::get(L, ridx + 1, col.name));
+                    stack::set_top(L, ridx);
+                });
+                stack::set_top(L, top + ncols);
+            }
+        } catch (...) {
+            stack::set_top(L, top);
+            throw;
+        }
+        stack::set_top(L, top);
+        return len;
+    }
+
+    // get several fields from the current table in one go, e.g.
+    // get_fields<types::INT, types::STR>("id", "name") returns std::tuple<long long, std::string>
+    // the stack is checked and reserved once for all the fields. only value types are supported
+    template<types... Types, class... Keys>
+    std::tuple<get_var_t<Types>...> get_fields(Keys... varnames) {
+        static_assert(sizeof...(Types) > 0 && sizeof...(Types) == sizeof...(Keys),
+            "get_fields() needs one key per type");
+        static_assert(std::is_same<std::integer_sequence<bool, true, is_value_type(Types)...>,
+                                   std::integer_sequence<bool, is_value_type(Types)..., true>>::value,
+            "get_fields() does not support types that return handles");
+        const char *keys[] = {varnames...};
+        auto base = push_fields(keys, sizeof...(Types));
+        try {
+            return get_fields_impl<Types...>(keys, std::index_sequence_for<Keys...>{});
+        } catch (...) {
+            restore_top(base);
+            throw;
+        }
+    }
+
     // get the length of current array. DOES NOT make sense if array contains holes
     // or if __len() metamethod does not return int
     long long len();
 
+    // references a function field of the current table, e.g. an event handler
+    function_ref get_function(const char *varname);
+
+    // appends the current table to buf in the MessagePack format, see lua_interpreter::pack_global()
+    void pack(std::string &buf);
+
+    // appends the current table to buf as JSON. tables are read with raw access and written as
+    // arrays if their keys are 1..#t, and as objects with string or number keys otherwise.
+    // on error buf is left unchanged
+    void to_json(std::string &buf);
+
     // MOVE
     table_handle(table_handle &&) noexcept;
     table_handle &operator=(table_handle &&) noexcept;
@@ -92,7 +1533,119 @@ private:
     std::shared_ptr<impl> pimpl;
     table_handle(std::shared_ptr<lua_interpreter::impl>, std::shared_ptr<impl>);
 
+    // checks the table is still on the stack
+    lua_State *checked_state();
+    int stack_index() const noexcept;
+
+    // get_fields() helpers
+    // pushes the fields in reverse order so they can be popped in order, returns the old top
+    int push_fields(const char *const *varnames, int n);
+    // converts and pops the field on the top of the stack
+    template<types Type>
+    get_var_t<Type> pop_field(const char *varname);
+    void restore_top(int top) noexcept;
+
+    template<types... Types, std::size_t... I>
+    std::tuple<get_var_t<Types>...> get_fields_impl(const char *const *keys, std::index_sequence<I...>) {
+        // braced initialization is evaluated from left to right
+        return std::tuple<get_var_t<Types>...>{pop_field<Types>(keys[I])...};
+    }
+
     friend class lua_interpreter;
+    friend class string_handle;
+    friend class table_builder;
+    friend struct value_traits<table_handle>;
+};
+
+// push only, pushes the table of the handle again, e.g. for call() or set_field()
+// the handle must belong to the same interpreter
+template<>
+struct value_traits<table_handle> {
+    static void push(lua_State *L, const table_handle &value);
+};
+
+// fills a new table created by lua_interpreter::build_table(), with raw sets
+// size the table with build_table() so it is not rehashed while filled
+// like table_handle, the table stays on the lua stack until the builder is finished or destroyed
+class table_builder {
+public:
+    // sets table[size() + 1] to a value of any C++ type with value_traits
+    template<class T>
+    table_builder &append(const T &value) {
+        auto L = handle.checked_state();
+        value_traits<T>::push(L, value);
+        stack::raw_set_index(L, handle.stack_index(), ++count);
+        return *this;
+    }
+
+    template<class T>
+    table_builder &set(const char *key, const T &value) {
+        auto L = handle.checked_state();
+        stack::push_string(L, key);
+        value_traits<T>::push(L, value);
+        stack::raw_set(L, handle.stack_index());
+        return *this;
+    }
+
+    // number of appended elements
+    long long size() const noexcept { return count; }
+
+    // FINISHING, the builder must not be used afterwards
+    // returns a handle to the table
+    table_handle build() noexcept { return std::move(handle); }
+    // assigns the table to a global variable, and pops it
+    void build_global(const char *varname);
+    // assigns the table to a field of another table, and pops it
+    void build_field(table_handle &parent, const char *varname);
+
+    // MOVE
+    table_builder(table_builder &&) noexcept;
+    table_builder &operator=(table_builder &&) noexcept;
+
+    // COPYING DELETED
+
+private:
+    table_handle handle;
+    long long count;
+    explicit table_builder(table_handle &&);
+
+    friend class lua_interpreter;
+};
+
+// RAII managed view of a lua string, obtained with types::STRVIEW
+// the string value is kept on the lua stack while this object is alive, so data() stays
+// valid without copying. it may contain embedded zeros; use size() instead of strlen()
+// same scoping rules as table_handle apply
+class string_handle {
+public:
+    // zero terminated like every lua string, but embedded zeros may come before size()
+    const char *data() const noexcept { return data_; }
+    std::size_t size() const noexcept { return size_; }
+
+    // copies the content
+    std::string str() const { return {data_, size_}; }
+
+#if __cplusplus >= 201703L
+    std::string_view view() const noexcept { return {data_, size_}; }
+    operator std::string_view() const noexcept { return view(); }
+#endif
+
+    // MOVE
+    string_handle(string_handle &&) noexcept;
+    string_handle &operator=(string_handle &&) noexcept;
+
+    // COPYING DELETED
+
+private:
+    // the string occupies a stack slot the same way a table does
+    std::shared_ptr<table_handle::impl> pin;
+    const char *data_;
+    std::size_t size_;
+    string_handle(std::shared_ptr<lua_interpreter::impl>, std::shared_ptr<table_handle::impl>,
+        const char *, std::size_t);
+
+    friend class lua_interpreter;
+    friend class table_handle;
 };
 
 } // namespace luai
@@ -0,0 +1,364 @@
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <queue>
+
+#include "lua.hpp"
+
+#include "lua_scheduler.hxx"
+
+using namespace luai;
+
+namespace {
+    using sched_clock = std::chrono::steady_clock;
+
+    // what a suspended task waits for
+    enum class wait_kind {
+        READY, FD, SLEEP
+    };
+
+    struct task {
+        coroutine co;
+        wait_kind waiting = wait_kind::READY;
+        int fd = -1;
+        // woken by sched.close() of its fd
+        bool closed = false;
+    };
+
+    struct timer {
+        sched_clock::time_point deadline;
+        int slot;
+
+        bool operator>(const timer &other) const noexcept { return deadline > other.deadline; }
+    };
+
+    // events read by one epoll_wait()
+    const int max_events = 64;
+
+    // longer sleeps are cut to about 31 years, so the deadline cannot overflow the clock
+    const double max_sleep_seconds = 1e9;
+}
+
+struct scheduler::impl {
+    lua_State *L;
+    int epfd;
+    // tasks do not move when more are added, even while one of them runs
+    std::deque<task> tasks;
+    std::vector<int> free_slots;
+    std::size_t alive = 0;
+    std::size_t nfds = 0;
+    // the slot waiting for each fd, or -1
+    std::vector<int> fd_waiters;
+    int current = -1;
+    std::deque<int> ready;
+    std::priority_queue<timer, std::vector<timer>, std::greater<timer>> timers;
+    std::vector<std::string> errors;
+    // the upvalue of the sched functions, a userdata holding this, anchored by box_ref
+    impl **box;
+    int box_ref;
+    epoll_event events[max_events];
+
+    explicit impl(lua_State *state) : L{state}, epfd{epoll_create1(EPOLL_CLOEXEC)} {
+        if (epfd < 0)
+            throw luastate_error{std::string{"cannot create epoll instance: "} + std::strerror(errno)};
+    }
+
+    impl(impl &&) = delete;
+    impl &operator=(impl &&) = delete;
+
+    ~impl() {
+        ::close(epfd);
+    }
+
+    // pop 0, push 0
+    void open_module() {
+        if (!lua_checkstack(L, 4))
+            throw luastate_error{"cannot grow Lua stack: out of memory"};
+        static const luaL_Reg funcs[] = {
+            {"readable", readable},
+            {"writable", writable},
+            {"sleep", sleep},
+            {"close", close_lua},
+            {NULL, NULL}
+        };
+        luaL_newlibtable(L, funcs);
+        box = static_cast<impl **>(lua_newuserdata(L, sizeof(impl *)));
+        *box = this;
+        lua_pushvalue(L, -1);
+        box_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        luaL_setfuncs(L, funcs, 1);
+        luaL_getsubtable(L, LUA_REGISTRYINDEX, "_LOADED");
+        lua_pushvalue(L, -2);
+        lua_setfield(L, -2, "sched");
+        lua_pop(L, 1);
+        lua_setglobal(L, "sched");
+    }
+
+    void close_module() noexcept {
+        *box = nullptr;
+        luaL_unref(L, LUA_REGISTRYINDEX, box_ref);
+    }
+
+    // the scheduler of a sched function, if L is the thread of its running task
+    static impl *running(lua_State *L) {
+        auto self = *static_cast<impl **>(lua_touserdata(L, lua_upvalueindex(1)));
+        if (!self || self->current < 0 || self->tasks[static_cast<std::size_t>(self->current)].co.thread() != L)
+            return nullptr;
+        return self;
+    }
+
+    // the scheduler of a sched function about to yield, raises an error before anything changes
+    // if the running task cannot yield here
+    static impl *waiting(lua_State *L) {
+        auto self = running(L);
+        if (!self)
+            luaL_error(L, "sched functions must be called by a scheduled task");
+        // e.g. from a table.sort comparator or a string.gsub callback
+        if (!lua_isyieldable(L))
+            luaL_error(L, "sched functions cannot wait across a C call");
+        return self;
+    }
+
+    static int wait_fd(lua_State *L, std::uint32_t events) {
+        auto fd = static_cast<int>(luaL_checkinteger(L, 1));
+        auto self = waiting(L);
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.u64 = static_cast<std::uint64_t>(self->current);
+        auto ok = stack::catch_to_message(L, [self, fd] {
+            if (static_cast<std::size_t>(fd) >= self->fd_waiters.size())
+                self->fd_waiters.resize(static_cast<std::size_t>(fd) + 1, -1);
+        });
+        if (!ok)
+            return lua_error(L);
+        if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+            return luaL_error(L, "cannot wait for fd %d: %s", fd, std::strerror(errno));
+        auto &t = self->tasks[static_cast<std::size_t>(self->current)];
+        t.waiting = wait_kind::FD;
+        t.fd = fd;
+        self->fd_waiters[static_cast<std::size_t>(fd)] = self->current;
+        ++self->nfds;
+        return lua_yieldk(L, 0, fd, fd_ready);
+    }
+
+    // continues readable() and writable() once woken
+    static int fd_ready(lua_State *L, int, lua_KContext fd) {
+        auto self = running(L);
+        if (self) {
+            auto &t = self->tasks[static_cast<std::size_t>(self->current)];
+            if (t.closed) {
+                t.closed = false;
+                return luaL_error(L, "fd %d was closed while waited on", static_cast<int>(fd));
+            }
+        }
+        return 0;
+    }
+
+    // stops waiting for fd, without waking the task
+    void forget_fd(int slot) noexcept {
+        auto &t = tasks[static_cast<std::size_t>(slot)];
+        epoll_ctl(epfd, EPOLL_CTL_DEL, t.fd, nullptr);
+        fd_waiters[static_cast<std::size_t>(t.fd)] = -1;
+        t.fd = -1;
+        --nfds;
+    }
+
+    // closes fd, failing the task waiting for it. returns false with errno set if close() failed
+    bool close_fd(int fd) {
+        if (fd >= 0 && static_cast<std::size_t>(fd) < fd_waiters.size() && fd_waiters[static_cast<std::size_t>(fd)] >= 0) {
+            auto slot = fd_waiters[static_cast<std::size_t>(fd)];
+            forget_fd(slot);
+            tasks[static_cast<std::size_t>(slot)].closed = true;
+            wake(slot);
+        }
+        return ::close(fd) == 0;
+    }
+
+    static int close_lua(lua_State *L) {
+        auto fd = static_cast<int>(luaL_checkinteger(L, 1));
+        auto self = *static_cast<impl **>(lua_touserdata(L, lua_upvalueindex(1)));
+        if (!self)
+            return luaL_error(L, "the scheduler was destroyed");
+        auto ok = true;
+        if (!stack::catch_to_message(L, [self, fd, &ok] { ok = self->close_fd(fd); }))
+            return lua_error(L);
+        return luaL_fileresult(L, ok, nullptr);
+    }
+
+    static int readable(lua_State *L) {
+        return wait_fd(L, EPOLLIN);
+    }
+
+    static int writable(lua_State *L) {
+        return wait_fd(L, EPOLLOUT);
+    }
+
+    static int sleep(lua_State *L) {
+        auto seconds = luaL_checknumber(L, 1);
+        luaL_argcheck(L, seconds == seconds, 1, "sleep time is NaN");
+        if (seconds > max_sleep_seconds)
+            seconds = max_sleep_seconds;
+        auto self = waiting(L);
+        // not sleeping at all only lets the other ready tasks run first
+        if (seconds > 0) {
+            auto ok = stack::catch_to_message(L, [self, seconds] {
+                auto deadline = sched_clock::now() + std::chrono::duration_cast<sched_clock::duration>(
+                    std::chrono::duration<double>(seconds));
+                self->timers.push({deadline, self->current});
+                self->tasks[static_cast<std::size_t>(self->current)].waiting = wait_kind::SLEEP;
+            });
+            if (!ok)
+                return lua_error(L);
+        }
+        return lua_yield(L, 0);
+    }
+
+    // milliseconds until the first timer, rounded up, or -1 without timers
+    int next_timeout() const {
+        if (timers.empty())
+            return -1;
+        auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(timers.top().deadline - sched_clock::now());
+        if (left.count() <= 0)
+            return 0;
+        auto ms = (left.count() + 999999) / 1000000;
+        return ms > INT32_MAX ? INT32_MAX : static_cast<int>(ms);
+    }
+
+    void wake(int slot) {
+        tasks[static_cast<std::size_t>(slot)].waiting = wait_kind::READY;
+        ready.push_back(slot);
+    }
+
+    void remove(int slot) noexcept {
+        auto &t = tasks[static_cast<std::size_t>(slot)];
+        // gives the thread back to the pool if it can be reused
+        t.co = coroutine{};
+        t.waiting = wait_kind::READY;
+        --alive;
+        try {
+            free_slots.push_back(slot);
+        } catch (const std::bad_alloc &) {
+            // the slot is lost, the task table only grows by one
+        }
+    }
+};
+
+scheduler::scheduler(lua_interpreter &interp)
+    : pimpl{std::make_unique<impl>(interp.lua_state())}, state{interp}
+{
+    pimpl->open_module();
+}
+
+scheduler::~scheduler() {
+    pimpl->close_module();
+}
+
+int scheduler::add(coroutine co) {
+    auto &s = *pimpl;
+    int slot;
+    if (s.free_slots.empty()) {
+        slot = static_cast<int>(s.tasks.size());
+        s.tasks.emplace_back();
+    } else {
+        slot = s.free_slots.back();
+        s.free_slots.pop_back();
+    }
+    s.tasks[static_cast<std::size_t>(slot)].co = std::move(co);
+    ++s.alive;
+    return slot;
+}
+
+coroutine &scheduler::enter(int slot) {
+    pimpl->current = slot;
+    return pimpl->tasks[static_cast<std::size_t>(slot)].co;
+}
+
+void scheduler::leave(int slot) {
+    auto &s = *pimpl;
+    s.current = -1;
+    auto &t = s.tasks[static_cast<std::size_t>(slot)];
+    switch (t.co.status()) {
+    case co_status::SUSPENDED:
+        // yielded without waiting for anything
+        if (t.waiting == wait_kind::READY)
+            s.ready.push_back(slot);
+        break;
+    case co_status::ERROR:
+        s.errors.push_back(t.co.error());
+        s.remove(slot);
+        break;
+    case co_status::DONE:
+        s.remove(slot);
+        break;
+    }
+}
+
+void scheduler::abandon(int slot) noexcept {
+    pimpl->current = -1;
+    pimpl->remove(slot);
+}
+
+std::size_t scheduler::run_once(int timeout_ms) {
+    auto &s = *pimpl;
+    if (s.alive == 0)
+        return 0;
+    if (!s.ready.empty()) {
+        timeout_ms = 0;
+    } else {
+        auto until_timer = s.next_timeout();
+        if (until_timer >= 0 && (timeout_ms < 0 || until_timer < timeout_ms))
+            timeout_ms = until_timer;
+    }
+    if (s.nfds > 0 || timeout_ms != 0) {
+        auto n = epoll_wait(s.epfd, s.events, max_events, timeout_ms);
+        if (n < 0 && errno != EINTR)
+            throw luastate_error{std::string{"epoll_wait failed: "} + std::strerror(errno)};
+        for (auto i = 0; i < n; ++i) {
+            auto slot = static_cast<int>(s.events[i].data.u64);
+            s.forget_fd(slot);
+            s.wake(slot);
+        }
+    }
+    auto now = sched_clock::now();
+    while (!s.timers.empty() && s.timers.top().deadline <= now) {
+        s.wake(s.timers.top().slot);
+        s.timers.pop();
+    }
+    // tasks queued while these run wait for the next round
+    for (auto n = s.ready.size(); n > 0; --n) {
+        auto slot = s.ready.front();
+        s.ready.pop_front();
+        auto &co = enter(slot);
+        try {
+            co.resume();
+        } catch (...) {
+            s.current = -1;
+            throw;
+        }
+        leave(slot);
+    }
+    return s.alive;
+}
+
+void scheduler::close(int fd) {
+    if (!pimpl->close_fd(fd))
+        throw luastate_error{"cannot close fd " + std::to_string(fd) + ": " + std::strerror(errno)};
+}
+
+void scheduler::run() {
+    while (run_once(-1) > 0) {}
+}
+
+std::size_t scheduler::size() const noexcept {
+    return pimpl->alive;
+}
+
+std::vector<std::string> &scheduler::errors() noexcept {
+    return pimpl->errors;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+// linux only: an epoll loop running many lua coroutines of one interpreter on one thread
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "lua_interpreter.hxx"
+
+namespace luai {
+
+// runs lua functions as tasks, each in a coroutine, resumed when what they wait for is ready.
+// scripts wait with the sched module:
+//     sched.readable(fd), sched.writable(fd)  return once the file descriptor is ready (or failed)
+//     sched.sleep(seconds)                    returns once the time passed
+//     sched.close(fd)                         closes fd like io.close(), failing the task waiting for it
+//     coroutine.yield()                       lets the other ready tasks run first
+// a file descriptor can only be waited for by one task at a time. closing it any other way while a
+// task waits for it silently drops it from epoll, and the task never wakes. the scheduler must be
+// destroyed before the interpreter, and only be used from one thread
+class scheduler {
+public:
+    // registers the sched module, it is also set as a global
+    explicit scheduler(lua_interpreter &state);
+
+    // COPYING AND MOVE DELETED, the sched functions point to the scheduler
+    scheduler(const scheduler &) = delete;
+    scheduler &operator=(const scheduler &) = delete;
+
+    ~scheduler();
+
+    // starts a task running the global function fname with args, until it first waits
+    // throws luastate_error if fname is not a function or an argument cannot be pushed
+    template<class... Args>
+    void spawn(const char *fname, const Args &... args) {
+        start(add(state.new_coroutine(fname)), args...);
+    }
+
+    template<class... Args>
+    void spawn(const function_ref &f, const Args &... args) {
+        start(add(state.new_coroutine(f)), args...);
+    }
+
+    // runs the tasks that are ready, waiting at most timeout_ms (-1 for no limit) for one to become
+    // ready if there is none. returns the number of tasks left
+    std::size_t run_once(int timeout_ms);
+
+    // runs until every task is done
+    void run();
+
+    // closes fd like sched.close(), the task waiting for it fails with an error once it runs
+    // throws luastate_error if close() fails
+    void close(int fd);
+
+    // the number of tasks that are not done
+    std::size_t size() const noexcept;
+
+    // the error messages of the tasks that failed, oldest first
+    std::vector<std::string> &errors() noexcept;
+
+private:
+    struct impl;
+    std::unique_ptr<impl> pimpl;
+    lua_interpreter &state;
+
+    // keeps the coroutine of a new task, returns its slot
+    int add(coroutine co);
+    // the coroutine of the task in slot, which becomes the running one
+    coroutine &enter(int slot);
+    // after the task in slot ran: queues or removes it
+    void leave(int slot);
+    // removes the task in slot without running it
+    void abandon(int slot) noexcept;
+
+    template<class... Args>
+    void start(int slot, const Args &... args) {
+        auto &co = enter(slot);
+        try {
+            co.resume(args...);
+        } catch (...) {
+            abandon(slot);
+            throw;
+        }
+        leave(slot);
+    }
+};
+
+} // namespace luai
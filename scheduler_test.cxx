@@ -0,0 +1,202 @@
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "lua_scheduler.hxx"
+
+#define ASSERT(condition)                                           \
+do {                                                                \
+    if(!(condition))                                                \
+        throw std::runtime_error(std::string( __FILE__ )            \
+                                + std::string( ":" )                \
+                                + std::to_string( __LINE__ )        \
+        );                                                          \
+} while (0)
+
+using namespace luai;
+
+// plain fd I/O for the scripts, called once sched says the fd is ready
+std::string read_fd(int fd) {
+    char buf[512];
+    auto n = ::read(fd, buf, sizeof buf);
+    if (n < 0)
+        throw std::runtime_error{std::strerror(errno)};
+    return {buf, static_cast<std::size_t>(n)};
+}
+
+long long write_fd(int fd, std::string data) {
+    auto n = ::write(fd, data.data(), data.size());
+    if (n < 0)
+        throw std::runtime_error{std::strerror(errno)};
+    return n;
+}
+
+void close_fd(int fd) {
+    ::close(fd);
+}
+
+int main() {
+    auto state = lua_interpreter{};
+    state.openlibs();
+    state.register_function("read_fd", read_fd);
+    state.register_function("write_fd", write_fd);
+    state.register_function("close_fd", close_fd);
+    ASSERT(std::get<0>(state.run_chunk(
+        "log = {}\n"
+        "function reader(fd)\n"
+        "    local got = {}\n"
+        "    while true do\n"
+        "        sched.readable(fd)\n"
+        "        local data = read_fd(fd)\n"
+        "        if data == '' then break end\n"
+        "        got[#got + 1] = data\n"
+        "    end\n"
+        "    close_fd(fd)\n"
+        "    received = table.concat(got)\n"
+        "end\n"
+        "function writer(fd, n)\n"
+        "    for i = 1, n do\n"
+        "        sched.writable(fd)\n"
+        "        write_fd(fd, i .. ';')\n"
+        "        sched.sleep(0.001)\n"
+        "    end\n"
+        "    close_fd(fd)\n"
+        "end\n"
+        "function echo(fd)\n"
+        "    sched.readable(fd)\n"
+        "    local line = read_fd(fd)\n"
+        "    sched.writable(fd)\n"
+        "    write_fd(fd, line:upper())\n"
+        "    close_fd(fd)\n"
+        "end\n"
+        "function client(fd, msg)\n"
+        "    write_fd(fd, msg)\n"
+        "    sched.readable(fd)\n"
+        "    replies[msg] = read_fd(fd)\n"
+        "    close_fd(fd)\n"
+        "end\n"
+        "function sleeper(name, seconds)\n"
+        "    sched.sleep(seconds)\n"
+        "    log[#log + 1] = name\n"
+        "end\n"
+        "function turns(name)\n"
+        "    for i = 1, 3 do log[#log + 1] = name .. i coroutine.yield() end\n"
+        "end\n"
+        "function broken() sched.sleep(0) error('broken task') end\n"
+        "function wait_read(fd) sched.readable(fd) end\n"
+    )));
+
+    scheduler sched{state};
+
+    // a pipe, the writer sleeping between writes
+    {
+        int fds[2];
+        ASSERT(pipe(fds) == 0);
+        sched.spawn("reader", fds[0]);
+        sched.spawn("writer", fds[1], 5);
+        ASSERT(sched.size() == 2);
+        sched.run();
+        ASSERT(sched.size() == 0 && sched.errors().empty());
+        ASSERT(state.get_global<types::STR>("received") == "1;2;3;4;5;");
+    }
+
+    // many unix socket pairs served at once
+    {
+        state.run_chunk("replies = {}");
+        for (auto i = 0; i < 200; ++i) {
+            int fds[2];
+            ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+            sched.spawn("echo", fds[0]);
+            sched.spawn("client", fds[1], "msg" + std::to_string(i));
+        }
+        ASSERT(sched.size() == 400);
+        sched.run();
+        ASSERT(sched.errors().empty());
+        auto replies = state.get_global<types::TABLE>("replies");
+        ASSERT(replies.get_field<types::STR>("msg0") == "MSG0");
+        ASSERT(replies.get_field<types::STR>("msg199") == "MSG199");
+    }
+
+    // timers fire in order, yields take turns
+    {
+        sched.spawn("sleeper", "slow", 0.03);
+        sched.spawn("sleeper", "fast", 0.01);
+        sched.spawn("turns", "a");
+        sched.spawn("turns", "b");
+        sched.run();
+        ASSERT(std::get<0>(state.run_chunk(
+            "assert(table.concat(log, ' ') == 'a1 b1 a2 b2 a3 b3 fast slow', table.concat(log, ' '))")));
+    }
+
+    // failures
+    {
+        sched.spawn("broken");
+        ASSERT(sched.size() == 1 && sched.errors().empty());
+        ASSERT(sched.run_once(0) == 0);
+        ASSERT(sched.errors().size() == 1 && sched.errors()[0].find("broken task") != std::string::npos);
+        sched.errors().clear();
+        auto ret = state.run_chunk("sched.sleep(1)");
+        ASSERT(!std::get<0>(ret) && std::get<1>(ret).find("scheduled task") != std::string::npos);
+        state.run_chunk("function sort_sleeping() table.sort({ 3, 1, 2 }, function(a, b) sched.sleep(0.01) return a < b end) end");
+        state.run_chunk("function sort_reading(fd) table.sort({ 3, 1, 2 }, function(a, b) sched.readable(fd) return a < b end) end");
+        sched.spawn("sort_sleeping");
+        int fds[2];
+        ASSERT(pipe(fds) == 0);
+        sched.spawn("sort_reading", fds[0]);
+        ASSERT(sched.size() == 0 && sched.errors().size() == 2);
+        ASSERT(sched.errors()[0].find("across a C call") != std::string::npos);
+        ASSERT(sched.errors()[1].find("across a C call") != std::string::npos);
+        sched.errors().clear();
+        // nothing was left registered for the failed tasks
+        ASSERT(sched.run_once(0) == 0);
+        sched.spawn("wait_read", fds[0]);
+        ASSERT(write(fds[1], "x", 1) == 1);
+        ASSERT(sched.run_once(-1) == 0 && sched.errors().empty());
+        close(fds[0]);
+        close(fds[1]);
+        state.run_chunk("function bad_fd() sched.readable(-1) end");
+        sched.spawn("bad_fd");
+        ASSERT(sched.size() == 0 && sched.errors().size() == 1);
+        auto thrown = false;
+        try {
+            sched.spawn("missing");
+        } catch (const luastate_error &) {
+            thrown = true;
+        }
+        ASSERT(thrown && sched.size() == 0);
+        sched.errors().clear();
+    }
+
+    // closing an fd a task waits for fails the task instead of leaving it waiting
+    {
+        int fds[2];
+        ASSERT(pipe(fds) == 0);
+        state.run_chunk("function closer(fd) sched.sleep(0) assert(sched.close(fd)) end");
+        sched.spawn("wait_read", fds[0]);
+        sched.spawn("closer", fds[0]);
+        sched.run();
+        ASSERT(sched.errors().size() == 1 && sched.errors()[0].find("was closed while waited on") != std::string::npos);
+        sched.errors().clear();
+        sched.spawn("wait_read", fds[1]);
+        sched.close(fds[1]);
+        sched.run();
+        ASSERT(sched.errors().size() == 1 && sched.errors()[0].find("was closed") != std::string::npos);
+        sched.errors().clear();
+        auto ret = state.run_chunk("local ok, msg = sched.close(-1) assert(not ok and msg)");
+        ASSERT(std::get<0>(ret));
+    }
+
+    // sleep times out of range
+    {
+        state.run_chunk("function nap(t) sched.sleep(t) end");
+        sched.spawn("nap", 0.0 / 0.0);
+        ASSERT(sched.size() == 0 && sched.errors().size() == 1 && sched.errors()[0].find("NaN") != std::string::npos);
+        sched.spawn("nap", 1.0 / 0.0);
+        sched.spawn("nap", 1e300);
+        ASSERT(sched.size() == 2 && sched.run_once(0) == 2);
+    }
+}